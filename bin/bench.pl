@@ -0,0 +1,108 @@
+#!/usr/bin/env perl
+use strict;
+use warnings;
+use File::Temp qw(tempfile);
+use Time::HiRes qw(time);
+
+# Arguments are options and a lexer name followed by its corpus files,
+# repeated: -b bench.base -l c *.c -l sh *.sh
+my (%opts, @lexers, %corpus);
+while (defined(my $arg = shift)) {
+	if ($arg eq '-l') {
+		push @lexers, shift;
+		$corpus{$lexers[-1]} = [];
+	} elsif ($arg =~ /^-([bjrstw])$/) {
+		$opts{$1} = shift;
+	} else {
+		die "corpus file $arg without lexer\n" unless @lexers;
+		push @{$corpus{$lexers[-1]}}, $arg;
+	}
+}
+
+my $hilex = $ENV{HILEX} // './hilex';
+my $runs = $opts{r} // 5;
+my $size = ($opts{s} // 16) * 1024 * 1024;
+my $threshold = ($opts{t} // 10) / 100;
+my $jobs = $opts{j} ? "-j $opts{j}" : '';
+my @formats = qw(count ansi debug html irc);
+
+sub corpus {
+	my ($lexer) = @_;
+	my $text = '';
+	for my $path (@{$corpus{$lexer}}) {
+		open my $file, '<', $path or die "$path: $!\n";
+		local $/;
+		$text .= <$file>;
+	}
+	die "empty corpus for $lexer\n" unless length $text;
+	my ($file, $path) = tempfile(UNLINK => 1);
+	my $len = 0;
+	while ($len < $size) {
+		print $file $text;
+		$len += length $text;
+	}
+	close $file;
+	return ($path, $len);
+}
+
+sub tokens {
+	my ($lexer, $path) = @_;
+	my $tokens = 0;
+	for (`$hilex -l $lexer -f count $path`) {
+		$tokens += $1 if /^\w+ (\d+)$/;
+	}
+	die "$hilex -l $lexer -f count failed\n" if $?;
+	return $tokens;
+}
+
+sub run {
+	my ($lexer, $format, $path) = @_;
+	my $best;
+	for (1 .. $runs) {
+		my $start = time;
+		system("$hilex $jobs -l $lexer -f $format $path >/dev/null") == 0
+			or die "$hilex -l $lexer -f $format failed\n";
+		my $time = time - $start;
+		$best = $time if !defined $best || $time < $best;
+	}
+	return $best;
+}
+
+my %base;
+if ($opts{b} && open my $file, '<', $opts{b}) {
+	while (<$file>) {
+		my ($lexer, $format, $mbps) = split;
+		$base{"$lexer $format"} = $mbps;
+	}
+}
+
+my @results;
+my $regressions = 0;
+printf "%-6s %-6s %10s %10s %8s\n", qw(lexer format MB/s Ktok/s base);
+for my $lexer (@lexers) {
+	my ($path, $len) = corpus($lexer);
+	my $tokens = tokens($lexer, $path);
+	for my $format (@formats) {
+		my $time = run($lexer, $format, $path);
+		my $mbps = $len / $time / 1e6;
+		my $ktps = $tokens / $time / 1e3;
+		push @results, sprintf "%s %s %.2f %.2f\n", $lexer, $format, $mbps, $ktps;
+		printf "%-6s %-6s %10.2f %10.2f", $lexer, $format, $mbps, $ktps;
+		my $base = $base{"$lexer $format"};
+		if (defined $base) {
+			my $change = ($mbps - $base) / $base;
+			printf " %+7.1f%%", 100 * $change;
+			if ($change < -$threshold) {
+				print ' REGRESSION';
+				$regressions++;
+			}
+		}
+		print "\n";
+	}
+}
+
+if ($opts{w}) {
+	open my $file, '>', $opts{w} or die "$opts{w}: $!\n";
+	print $file @results;
+}
+exit ($regressions ? 1 : 0);
@@ -0,0 +1,332 @@
+/* Copyright (C) 2026  C. McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "hilex.h"
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
+
+static const uint32_t K[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
+	0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+	0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+	0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7,
+	0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+	0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3,
+	0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5,
+	0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+	0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+static struct {
+	uint32_t h[8];
+	uint8_t block[64];
+	size_t len;
+	uint64_t total;
+} sha;
+
+static uint32_t ror(uint32_t x, int n) {
+	return x >> n | x << (32 - n);
+}
+
+static void shaBlock(const uint8_t *block) {
+	uint32_t w[64];
+	for (int i = 0; i < 16; ++i) {
+		w[i] = (uint32_t)block[4*i] << 24 | (uint32_t)block[4*i+1] << 16
+			| (uint32_t)block[4*i+2] << 8 | block[4*i+3];
+	}
+	for (int i = 16; i < 64; ++i) {
+		uint32_t s0 = ror(w[i-15], 7) ^ ror(w[i-15], 18) ^ w[i-15] >> 3;
+		uint32_t s1 = ror(w[i-2], 17) ^ ror(w[i-2], 19) ^ w[i-2] >> 10;
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+	uint32_t a = sha.h[0], b = sha.h[1], c = sha.h[2], d = sha.h[3];
+	uint32_t e = sha.h[4], f = sha.h[5], g = sha.h[6], h = sha.h[7];
+	for (int i = 0; i < 64; ++i) {
+		uint32_t s1 = ror(e, 6) ^ ror(e, 11) ^ ror(e, 25);
+		uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + K[i] + w[i];
+		uint32_t s0 = ror(a, 2) ^ ror(a, 13) ^ ror(a, 22);
+		uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	sha.h[0] += a; sha.h[1] += b; sha.h[2] += c; sha.h[3] += d;
+	sha.h[4] += e; sha.h[5] += f; sha.h[6] += g; sha.h[7] += h;
+}
+
+static void shaInit(void) {
+	static const uint32_t H[8] = {
+		0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+		0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+	};
+	memcpy(sha.h, H, sizeof(H));
+	sha.len = 0;
+	sha.total = 0;
+}
+
+static void shaUpdate(const void *ptr, size_t len) {
+	const uint8_t *bytes = ptr;
+	sha.total += len;
+	if (sha.len) {
+		size_t n = sizeof(sha.block) - sha.len;
+		if (n > len) n = len;
+		memcpy(&sha.block[sha.len], bytes, n);
+		sha.len += n;
+		bytes += n;
+		len -= n;
+		if (sha.len < sizeof(sha.block)) return;
+		shaBlock(sha.block);
+		sha.len = 0;
+	}
+	for (; len >= sizeof(sha.block); bytes += 64, len -= 64) {
+		shaBlock(bytes);
+	}
+	memcpy(sha.block, bytes, len);
+	sha.len = len;
+}
+
+static void shaFinal(char hex[static 65]) {
+	uint64_t bits = sha.total * 8;
+	uint8_t pad[72] = { 0x80 };
+	size_t n = (sha.len < 56 ? 56 : 120) - sha.len;
+	for (int i = 0; i < 8; ++i) {
+		pad[n + i] = bits >> (56 - 8 * i);
+	}
+	shaUpdate(pad, n + 8);
+	for (int i = 0; i < 8; ++i) {
+		snprintf(&hex[8 * i], 9, "%08x", (unsigned)sha.h[i]);
+	}
+}
+
+enum Counter {
+	Hits,
+	Misses,
+	Evictions,
+	CounterCap,
+};
+
+static const char *Counters[CounterCap] = {
+	[Hits] = "hilex_cache_hits_total",
+	[Misses] = "hilex_cache_misses_total",
+	[Evictions] = "hilex_cache_evictions_total",
+};
+
+static const char *path;
+static int dir = -1;
+static char name[65];
+static char temp[4096];
+
+// Counters are kept as text in the stats file for scraping.
+static void count(enum Counter counter, unsigned long n) {
+	int fd = openat(dir, "stats", O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		warn("stats");
+		return;
+	}
+	FILE *file = fdopen(fd, "r+");
+	if (!file) err(EX_OSERR, "fdopen");
+	int error = flock(fd, LOCK_EX);
+	if (error) warn("flock");
+
+	unsigned long values[CounterCap] = {0};
+	char key[64];
+	unsigned long value;
+	while (2 == fscanf(file, "%63s %lu", key, &value)) {
+		for (size_t i = 0; i < ARRAY_LEN(Counters); ++i) {
+			if (!strcmp(key, Counters[i])) values[i] = value;
+		}
+	}
+	values[counter] += n;
+
+	rewind(file);
+	for (size_t i = 0; i < ARRAY_LEN(Counters); ++i) {
+		fprintf(file, "%s %lu\n", Counters[i], values[i]);
+	}
+	fflush(file);
+	error = ftruncate(fd, ftello(file));
+	if (error) warn("ftruncate");
+	fclose(file);
+}
+
+static void copy(int fd, off_t size) {
+#ifdef __linux__
+	while (size > 0) {
+		ssize_t n = sendfile(STDOUT_FILENO, fd, NULL, size);
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS)) break;
+		if (n < 0) err(EX_IOERR, "sendfile");
+		if (!n) return;
+		size -= n;
+	}
+#else
+	(void)size;
+#endif
+	char buf[64 * 1024];
+	for (ssize_t n; 0 < (n = read(fd, buf, sizeof(buf)));) {
+		for (ssize_t i = 0; i < n;) {
+			ssize_t w = write(STDOUT_FILENO, &buf[i], n - i);
+			if (w < 0) err(EX_IOERR, "write");
+			i += w;
+		}
+	}
+}
+
+bool
+cacheHit(const char *_path, const char *key, const char *buf, size_t len) {
+	path = _path;
+	dir = open(path, O_RDONLY | O_DIRECTORY);
+	if (dir < 0) {
+		warn("%s", path);
+		return false;
+	}
+	shaInit();
+	shaUpdate(key, strlen(key) + 1);
+	shaUpdate(buf, len);
+	shaFinal(name);
+
+	int fd = openat(dir, name, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) warn("%s/%s", path, name);
+		count(Misses, 1);
+		return false;
+	}
+	struct stat st;
+	int error = fstat(fd, &st);
+	if (error) err(EX_IOERR, "%s/%s", path, name);
+	// Touch the entry so eviction sees it as recently used:
+	futimens(fd, NULL);
+	copy(fd, st.st_size);
+	close(fd);
+	count(Hits, 1);
+	return true;
+}
+
+FILE *cacheCreate(void) {
+	if (dir < 0) return NULL;
+	snprintf(temp, sizeof(temp), "%s/.tmp.XXXXXXXX", path);
+	int fd = mkstemp(temp);
+	if (fd < 0) {
+		warn("%s", temp);
+		return NULL;
+	}
+	fchmod(fd, 0644);
+	FILE *file = fdopen(fd, "w");
+	if (!file) err(EX_OSERR, "fdopen");
+	return file;
+}
+
+struct Entry {
+	char name[65];
+	off_t size;
+	time_t mtime;
+};
+
+static int compare(const void *_a, const void *_b) {
+	const struct Entry *a = _a, *b = _b;
+	return (a->mtime > b->mtime) - (a->mtime < b->mtime);
+}
+
+static void evict(off_t max) {
+	int fd = dup(dir);
+	if (fd < 0) err(EX_OSERR, "dup");
+	DIR *list = fdopendir(fd);
+	if (!list) err(EX_OSERR, "fdopendir");
+	rewinddir(list);
+
+	size_t len = 0, cap = 64;
+	struct Entry *entries = malloc(cap * sizeof(*entries));
+	if (!entries) err(EX_OSERR, "malloc");
+
+	// Temporary files left by a process which died before storing its
+	// entry are removed once they are surely no longer being written.
+	time_t stale = time(NULL) - 60 * 60;
+
+	off_t total = 0;
+	struct dirent *entry;
+	while (NULL != (errno = 0, entry = readdir(list))) {
+		if (!strncmp(entry->d_name, ".tmp.", 5)) {
+			struct stat st;
+			int error = fstatat(dir, entry->d_name, &st, 0);
+			if (!error && st.st_mtime < stale) {
+				unlinkat(dir, entry->d_name, 0);
+			}
+			continue;
+		}
+		if (strlen(entry->d_name) != 64) continue;
+		if (strspn(entry->d_name, "0123456789abcdef") != 64) continue;
+		struct stat st;
+		int error = fstatat(dir, entry->d_name, &st, 0);
+		if (error) continue;
+		if (len == cap) {
+			entries = realloc(entries, (cap *= 2) * sizeof(*entries));
+			if (!entries) err(EX_OSERR, "realloc");
+		}
+		memcpy(entries[len].name, entry->d_name, 65);
+		entries[len].size = st.st_size;
+		entries[len].mtime = st.st_mtime;
+		total += st.st_size;
+		len++;
+	}
+	if (errno) err(EX_IOERR, "readdir");
+	closedir(list);
+
+	unsigned long evictions = 0;
+	qsort(entries, len, sizeof(*entries), compare);
+	for (size_t i = 0; i < len && total > max; ++i) {
+		int error = unlinkat(dir, entries[i].name, 0);
+		if (error && errno != ENOENT) warn("%s", entries[i].name);
+		if (error) continue;
+		total -= entries[i].size;
+		evictions++;
+	}
+	free(entries);
+	if (evictions) count(Evictions, evictions);
+}
+
+void cacheStore(FILE *file, size_t max) {
+	int error = fclose(file);
+	if (!error) error = renameat(AT_FDCWD, temp, dir, name);
+	if (error) {
+		warn("%s", temp);
+		unlink(temp);
+		return;
+	}
+	evict(max);
+}
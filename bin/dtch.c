@@ -17,13 +17,16 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <locale.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
@@ -40,12 +43,14 @@
 #include <util.h>
 #endif
 
-static char _;
-static struct iovec iov = { .iov_base = &_, .iov_len = 1 };
+#include "term.h"
 
-static ssize_t sendfd(int sock, int fd) {
+// A descriptor is sent with one byte, which for a pty is the version of the
+// screen protocol, and zero from sessions which predate it.
+static ssize_t sendfd(int sock, int fd, char byte) {
 	size_t len = CMSG_SPACE(sizeof(int));
 	char buf[len];
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
 	struct msghdr msg = {
 		.msg_iov = &iov,
 		.msg_iovlen = 1,
@@ -62,9 +67,10 @@ static ssize_t sendfd(int sock, int fd) {
 	return sendmsg(sock, &msg, 0);
 }
 
-static int recvfd(int sock) {
+static int recvfd(int sock, char *byte) {
 	size_t len = CMSG_SPACE(sizeof(int));
 	char buf[len];
+	struct iovec iov = { .iov_base = byte, .iov_len = 1 };
 	struct msghdr msg = {
 		.msg_iov = &iov,
 		.msg_iovlen = 1,
@@ -78,9 +84,12 @@ static int recvfd(int sock) {
 		errno = ENOMSG;
 		return -1;
 	}
-	return *(int *)CMSG_DATA(cmsg);
+	int fd = *(int *)CMSG_DATA(cmsg);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
 }
 
+static const char *home;
 static struct sockaddr_un addr = { .sun_family = AF_UNIX };
 
 static void handler(int sig) {
@@ -88,7 +97,177 @@ static void handler(int sig) {
 	_exit(-sig);
 }
 
-static void detach(int server, bool sink, char *argv[]) {
+// The screen of a session is kept up to date with output read while
+// detached, and with output mirrored back by the attached client. On attach
+// it is drawn to the client before the client reads from the pty.
+static struct Term *screen(int pty) {
+	struct winsize window;
+	int error = ioctl(pty, TIOCGWINSZ, &window);
+	if (error || !window.ws_row || !window.ws_col) {
+		window = (struct winsize) { .ws_row = 24, .ws_col = 80 };
+	}
+	return termAlloc(window.ws_row, window.ws_col, false);
+}
+
+static void
+screenUpdate(struct Term *term, int pty, const char *buf, size_t len) {
+	struct winsize window;
+	int error = ioctl(pty, TIOCGWINSZ, &window);
+	if (!error && window.ws_row && window.ws_col) {
+		termResize(term, window.ws_row, window.ws_col);
+	}
+	termWrite(term, buf, len);
+}
+
+// Sessions which send the pty with a version send the screen after a magic
+// and its length, even if empty, once the client asks for it with a byte.
+enum { ScreenVersion = 1 };
+static const char ScreenMagic[8] = "dtchscr1";
+
+// Returns the screen as sent to a client, after the magic and its length.
+static char *screenBuf(struct Term *term, size_t *len) {
+	char *buf;
+	FILE *file = open_memstream(&buf, len);
+	if (!file) err(EX_OSERR, "open_memstream");
+	size_t draw = 0;
+	fwrite(ScreenMagic, sizeof(ScreenMagic), 1, file);
+	fwrite(&draw, sizeof(draw), 1, file);
+	termDraw(file, term);
+	int error = fclose(file);
+	if (error) err(EX_OSERR, "open_memstream");
+	draw = *len - sizeof(ScreenMagic) - sizeof(draw);
+	memcpy(&buf[sizeof(ScreenMagic)], &draw, sizeof(draw));
+	return buf;
+}
+
+static void screenSend(int client, struct Term *term) {
+	size_t len;
+	char *buf = screenBuf(term, &len);
+	ssize_t n = send(client, buf, len, MSG_NOSIGNAL);
+	if (n < 0) warn("send");
+	free(buf);
+}
+
+// Output is logged to a fixed size file of the session name with ".log"
+// appended, as a ring buffer following a header of the total written.
+static const char LogMagic[8] = "dtchlog";
+
+struct Log {
+	char magic[8];
+	uint64_t size;
+	uint64_t head;
+	char data[];
+};
+
+static size_t parseSize(const char *str) {
+	char *end;
+	size_t size = strtoull(str, &end, 0);
+	switch (*end) {
+		break; case 'G': case 'g': size <<= 30;
+		break; case 'M': case 'm': size <<= 20;
+		break; case 'K': case 'k': size <<= 10;
+		break; case '\0': break;
+		break; default: errx(EX_USAGE, "invalid size %s", str);
+	}
+	return size;
+}
+
+static struct Log *logOpen(const char *sock, size_t size) {
+	if (!size) return NULL;
+	char path[sizeof(addr.sun_path) + 4];
+	snprintf(path, sizeof(path), "%s.log", sock);
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) err(EX_CANTCREAT, "%s", path);
+	int error = ftruncate(fd, sizeof(struct Log) + size);
+	if (error) err(EX_IOERR, "%s", path);
+	struct Log *log = mmap(
+		NULL, sizeof(*log) + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+	);
+	if (log == MAP_FAILED) err(EX_IOERR, "%s", path);
+	close(fd);
+	log->size = size;
+	memcpy(log->magic, LogMagic, sizeof(log->magic));
+	return log;
+}
+
+static void logClose(struct Log *log) {
+	if (log) munmap(log, sizeof(*log) + log->size);
+}
+
+static void logWrite(struct Log *log, const char *buf, size_t len) {
+	if (!log) return;
+	if (len > log->size) {
+		buf += len - log->size;
+		log->head += len - log->size;
+		len = log->size;
+	}
+	while (len) {
+		size_t pos = log->head % log->size;
+		size_t n = log->size - pos;
+		if (n > len) n = len;
+		memcpy(&log->data[pos], buf, n);
+		log->head += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+// Print the last lines of the log, or the last bytes if lines is zero.
+static void logTail(const char *sock, size_t lines, size_t bytes) {
+	char path[sizeof(addr.sun_path) + 4];
+	snprintf(path, sizeof(path), "%s.log", sock);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) err(EX_NOINPUT, "%s", path);
+	struct stat st;
+	int error = fstat(fd, &st);
+	if (error) err(EX_IOERR, "%s", path);
+	if ((size_t)st.st_size <= sizeof(struct Log)) {
+		errx(EX_DATAERR, "%s: invalid log", path);
+	}
+	const struct Log *log = mmap(
+		NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0
+	);
+	if (log == MAP_FAILED) err(EX_IOERR, "%s", path);
+	close(fd);
+	if (
+		memcmp(log->magic, LogMagic, sizeof(log->magic)) ||
+		log->size != st.st_size - sizeof(*log)
+	) {
+		errx(EX_DATAERR, "%s: invalid log", path);
+	}
+
+	uint64_t head = log->head;
+	size_t len = (head < log->size ? head : log->size);
+	char *buf = malloc(len + 1);
+	if (!buf) err(EX_OSERR, "malloc");
+	size_t pos = (head - len) % log->size;
+	size_t n = (len < log->size - pos ? len : log->size - pos);
+	memcpy(buf, &log->data[pos], n);
+	memcpy(&buf[n], log->data, len - n);
+	// Drop anything overwritten while copying:
+	uint64_t lost = log->head - head;
+	size_t start = (lost < len ? lost : len);
+
+	if (lines) {
+		size_t end = len;
+		if (end > start && buf[end - 1] == '\n') end--;
+		while (end > start) {
+			if (buf[end - 1] == '\n' && !--lines) break;
+			end--;
+		}
+		start = end;
+	} else if (len - start > bytes) {
+		start = len - bytes;
+	}
+	if (len > start && !fwrite(&buf[start], len - start, 1, stdout)) {
+		err(EX_IOERR, "(stdout)");
+	}
+	fflush(stdout);
+	free(buf);
+	munmap((void *)log, st.st_size);
+}
+
+static void detach(int server, bool sink, size_t logSize, char *argv[]) {
 	int pty;
 	pid_t pid = forkpty(&pty, NULL, NULL, NULL);
 	if (pid < 0) err(EX_OSERR, "forkpty");
@@ -104,6 +283,10 @@ static void detach(int server, bool sink, char *argv[]) {
 	int error = listen(server, 0);
 	if (error) err(EX_OSERR, "listen");
 
+	char buf[4096];
+	struct Term *term = screen(pty);
+	struct Log *log = logOpen(addr.sun_path, logSize);
+
 	struct pollfd fds[] = {
 		{ .events = POLLIN, .fd = server },
 		{ .events = POLLIN, .fd = pty },
@@ -113,19 +296,26 @@ static void detach(int server, bool sink, char *argv[]) {
 			int client = accept(server, NULL, NULL);
 			if (client < 0) err(EX_IOERR, "accept");
 
-			ssize_t len = sendfd(client, pty);
+			char version;
+			ssize_t len = sendfd(client, pty, ScreenVersion);
 			if (len < 0) warn("sendfd");
+			if (len >= 0) len = recv(client, &version, 1, 0);
+			if (len > 0) screenSend(client, term);
 
-			len = recv(client, &_, sizeof(_), 0);
+			while (0 < (len = recv(client, buf, sizeof(buf), 0))) {
+				screenUpdate(term, pty, buf, len);
+				logWrite(log, buf, len);
+			}
 			if (len < 0) warn("recv");
 
 			close(client);
 		}
 
 		if (fds[1].revents) {
-			char buf[4096];
 			ssize_t len = read(pty, buf, sizeof(buf));
 			if (len < 0) err(EX_IOERR, "read");
+			screenUpdate(term, pty, buf, len);
+			logWrite(log, buf, len);
 		}
 
 		int status;
@@ -139,6 +329,485 @@ static void detach(int server, bool sink, char *argv[]) {
 	err(EX_IOERR, "poll");
 }
 
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+extern char **environ;
+
+// Sessions are found by any of their file descriptors.
+static struct Session {
+	struct sockaddr_un addr;
+	pid_t pid;
+	int server;
+	int pty;
+	int client;
+	bool sink;
+	struct Term *term;
+	struct Log *log;
+} **sessions;
+
+// Requests and screens are read and written as the sockets become ready, so
+// that one slow client does not stall every session.
+static struct Conn {
+	int dir;
+	struct Session *session;
+	bool writing;
+	char *buf;
+	size_t len, cap, sent;
+} **conns;
+static size_t fdsCap;
+
+static void reserve(int fd) {
+	if ((size_t)fd < fdsCap) return;
+	size_t cap = (fdsCap ? fdsCap : 64);
+	while (cap <= (size_t)fd) cap *= 2;
+	sessions = realloc(sessions, cap * sizeof(*sessions));
+	if (!sessions) err(EX_OSERR, "realloc");
+	conns = realloc(conns, cap * sizeof(*conns));
+	if (!conns) err(EX_OSERR, "realloc");
+	memset(&sessions[fdsCap], 0, (cap - fdsCap) * sizeof(*sessions));
+	memset(&conns[fdsCap], 0, (cap - fdsCap) * sizeof(*conns));
+	fdsCap = cap;
+}
+
+static void track(int fd, struct Session *session) {
+	reserve(fd);
+	sessions[fd] = session;
+}
+
+static void watchFor(int epoll, int op, int fd, uint32_t events) {
+	struct epoll_event event = { .events = events, .data.fd = fd };
+	int error = epoll_ctl(epoll, op, fd, &event);
+	if (error) err(EX_OSERR, "epoll_ctl");
+}
+
+static void watch(int epoll, int fd) {
+	watchFor(epoll, EPOLL_CTL_ADD, fd, EPOLLIN);
+}
+
+static void unwatch(int epoll, int fd) {
+	epoll_ctl(epoll, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static struct Conn *connOpen(int fd, struct Session *session) {
+	struct Conn *conn = calloc(1, sizeof(*conn));
+	if (!conn) err(EX_OSERR, "calloc");
+	conn->dir = -1;
+	conn->session = session;
+	reserve(fd);
+	conns[fd] = conn;
+	return conn;
+}
+
+static void connFree(int fd) {
+	struct Conn *conn = conns[fd];
+	if (conn->dir >= 0) close(conn->dir);
+	free(conn->buf);
+	free(conn);
+	conns[fd] = NULL;
+}
+
+static void connClose(int epoll, int fd) {
+	unwatch(epoll, fd);
+	connFree(fd);
+	close(fd);
+}
+
+static void sessionClose(int epoll, struct Session *session) {
+	unlink(session->addr.sun_path);
+	int fds[] = { session->server, session->pty, session->client };
+	for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+		if (fds[i] < 0) continue;
+		unwatch(epoll, fds[i]);
+		if (conns[fds[i]]) connFree(fds[i]);
+		sessions[fds[i]] = NULL;
+		close(fds[i]);
+	}
+	termFree(session->term);
+	logClose(session->log);
+	free(session);
+}
+
+static sigset_t mask;
+
+static const char *sessionSpawn(
+	int epoll, int dir, const char *name, bool sink, size_t logSize,
+	char *argv[]
+) {
+	if (!name[0] || name[0] == '.' || strchr(name, '/')) {
+		return "invalid session name";
+	}
+	if (!argv[0]) return "no command";
+
+	struct Session *session = calloc(1, sizeof(*session));
+	if (!session) err(EX_OSERR, "calloc");
+	session->addr.sun_family = AF_UNIX;
+	snprintf(
+		session->addr.sun_path, sizeof(session->addr.sun_path),
+		"%s/.dtch/%s", home, name
+	);
+	session->sink = sink;
+	session->client = -1;
+
+	session->server = socket(
+		PF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0
+	);
+	if (session->server < 0) err(EX_OSERR, "socket");
+	int error = bind(
+		session->server,
+		(struct sockaddr *)&session->addr, SUN_LEN(&session->addr)
+	);
+	if (error) {
+		close(session->server);
+		free(session);
+		return strerror(errno);
+	}
+	error = listen(session->server, 0);
+	if (error) err(EX_OSERR, "listen");
+
+	session->pid = forkpty(&session->pty, NULL, NULL, NULL);
+	if (session->pid < 0) err(EX_OSERR, "forkpty");
+
+	if (!session->pid) {
+		sigprocmask(SIG_UNBLOCK, &mask, NULL);
+		if (fchdir(dir) < 0) err(EX_NOINPUT, "fchdir");
+		close(dir);
+		execvp(argv[0], argv);
+		err(EX_NOINPUT, "%s", argv[0]);
+	}
+
+	fcntl(session->pty, F_SETFD, FD_CLOEXEC);
+	fcntl(session->pty, F_SETFL, O_NONBLOCK);
+	session->term = screen(session->pty);
+	session->log = logOpen(session->addr.sun_path, logSize);
+	track(session->server, session);
+	track(session->pty, session);
+	watch(epoll, session->server);
+	if (sink) watch(epoll, session->pty);
+	return NULL;
+}
+
+// A request is the session name, flags, the command and the environment, as
+// strings terminated by NUL and an empty string after the command, sent
+// after the working directory.
+static const char *sessionRequest(int epoll, int dir, char *buf, size_t len) {
+	size_t cap = 0;
+	for (size_t i = 0; i < len; ++i) {
+		if (!buf[i]) cap++;
+	}
+	char **strs = calloc(cap + 2, sizeof(*strs));
+	if (!strs) err(EX_OSERR, "calloc");
+	size_t n = 0;
+	for (char *ptr = buf; ptr < &buf[len]; ptr += strlen(ptr) + 1) {
+		strs[n++] = ptr;
+	}
+
+	const char *error = "malformed request";
+	size_t args = 2;
+	while (args < n && strs[args][0]) args++;
+	if (args < n) {
+		char **env = environ;
+		strs[args] = NULL;
+		environ = &strs[args + 1];
+		const char *size = strchr(strs[1], 'b');
+		error = sessionSpawn(
+			epoll, dir, strs[0], strchr(strs[1], 's'),
+			(size ? strtoull(&size[1], NULL, 10) : 0), &strs[2]
+		);
+		environ = env;
+	}
+	free(strs);
+	return error;
+}
+
+static void sessionControl(int epoll, int control) {
+	int client = accept(control, NULL, NULL);
+	if (client < 0) {
+		if (errno != EAGAIN) warn("accept");
+		return;
+	}
+	fcntl(client, F_SETFD, FD_CLOEXEC);
+	fcntl(client, F_SETFL, O_NONBLOCK);
+	connOpen(client, NULL);
+	watch(epoll, client);
+}
+
+static void connReply(int epoll, int fd, const char *error) {
+	struct Conn *conn = conns[fd];
+	if (conn->cap < 256) {
+		conn->buf = realloc(conn->buf, 256);
+		if (!conn->buf) err(EX_OSERR, "realloc");
+		conn->cap = 256;
+	}
+	conn->len = snprintf(
+		conn->buf, conn->cap, "%c%s", (error ? EX_UNAVAILABLE : EX_OK),
+		(error ? error : "")
+	);
+	if (conn->len >= conn->cap) conn->len = conn->cap - 1;
+	conn->writing = true;
+	watchFor(epoll, EPOLL_CTL_MOD, fd, EPOLLOUT);
+}
+
+static void connRead(int epoll, int fd) {
+	enum { RequestCap = 1024 * 1024 };
+	struct Conn *conn = conns[fd];
+	if (conn->dir < 0) {
+		char byte;
+		conn->dir = recvfd(fd, &byte);
+		if (conn->dir < 0 && errno == EAGAIN) return;
+		if (conn->dir < 0) {
+			connReply(epoll, fd, "no working directory");
+			return;
+		}
+	}
+	for (;;) {
+		if (conn->len + 1 >= conn->cap) {
+			if (conn->cap == RequestCap) {
+				connReply(epoll, fd, "request too long");
+				return;
+			}
+			conn->cap = (conn->cap ? conn->cap * 2 : 4096);
+			conn->buf = realloc(conn->buf, conn->cap);
+			if (!conn->buf) err(EX_OSERR, "realloc");
+		}
+		ssize_t n = read(
+			fd, &conn->buf[conn->len], conn->cap - 1 - conn->len
+		);
+		if (n < 0 && errno == EAGAIN) return;
+		if (n < 0) {
+			connClose(epoll, fd);
+			return;
+		}
+		if (!n) break;
+		conn->len += n;
+	}
+	conn->buf[conn->len] = '\0';
+	const char *error = sessionRequest(epoll, conn->dir, conn->buf, conn->len);
+	connReply(epoll, fd, error);
+}
+
+static void sessionDetach(int epoll, struct Session *session) {
+	unwatch(epoll, session->client);
+	sessions[session->client] = NULL;
+	close(session->client);
+	session->client = -1;
+	watch(epoll, session->server);
+	if (session->sink) watch(epoll, session->pty);
+}
+
+static void connWrite(int epoll, int fd) {
+	struct Conn *conn = conns[fd];
+	ssize_t n = send(
+		fd, &conn->buf[conn->sent], conn->len - conn->sent, MSG_NOSIGNAL
+	);
+	if (n < 0 && errno == EAGAIN) return;
+	if (n >= 0) conn->sent += n;
+	if (n >= 0 && conn->sent < conn->len) return;
+
+	struct Session *session = conn->session;
+	if (!session) {
+		connClose(epoll, fd);
+	} else if (n < 0) {
+		connFree(fd);
+		sessionDetach(epoll, session);
+	} else {
+		// Leave the pty to the client until it detaches, as detach does.
+		connFree(fd);
+		watchFor(epoll, EPOLL_CTL_MOD, fd, EPOLLIN);
+	}
+}
+
+static void connScreen(int epoll, int fd) {
+	struct Conn *conn = conns[fd];
+	char version;
+	ssize_t n = recv(fd, &version, 1, 0);
+	if (n < 0 && errno == EAGAIN) return;
+	if (n <= 0) {
+		struct Session *session = conn->session;
+		connFree(fd);
+		sessionDetach(epoll, session);
+		return;
+	}
+	conn->buf = screenBuf(conn->session->term, &conn->len);
+	conn->writing = true;
+	watchFor(epoll, EPOLL_CTL_MOD, fd, EPOLLOUT);
+}
+
+static void connEvent(int epoll, int fd) {
+	if (conns[fd]->writing) {
+		connWrite(epoll, fd);
+	} else if (conns[fd]->session) {
+		connScreen(epoll, fd);
+	} else {
+		connRead(epoll, fd);
+	}
+}
+
+static void sessionEvent(int epoll, struct Session *session, int fd) {
+	if (fd == session->server) {
+		int client = accept(session->server, NULL, NULL);
+		if (client < 0) {
+			if (errno != EAGAIN) warn("accept");
+			return;
+		}
+		fcntl(client, F_SETFD, FD_CLOEXEC);
+		fcntl(client, F_SETFL, O_NONBLOCK);
+		ssize_t len = sendfd(client, session->pty, ScreenVersion);
+		if (len < 0) {
+			warn("sendfd");
+			close(client);
+			return;
+		}
+		// Stop reading the pty so that the screen matches it when sent.
+		session->client = client;
+		unwatch(epoll, session->server);
+		if (session->sink) unwatch(epoll, session->pty);
+		track(client, session);
+		connOpen(client, session);
+		watch(epoll, client);
+
+	} else if (fd == session->client) {
+		char buf[4096];
+		ssize_t len = recv(session->client, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0 && errno == EAGAIN) return;
+		if (len > 0) {
+			screenUpdate(session->term, session->pty, buf, len);
+			logWrite(session->log, buf, len);
+			return;
+		}
+		sessionDetach(epoll, session);
+
+	} else if (fd == session->pty) {
+		char buf[4096];
+		ssize_t len = read(session->pty, buf, sizeof(buf));
+		if (len < 0 && errno == EAGAIN) return;
+		if (len <= 0) {
+			unwatch(epoll, session->pty);
+			return;
+		}
+		screenUpdate(session->term, session->pty, buf, len);
+		logWrite(session->log, buf, len);
+	}
+}
+
+static void sessionReap(int epoll) {
+	int status;
+	for (pid_t pid; 0 < (pid = waitpid(-1, &status, WNOHANG));) {
+		for (size_t fd = 0; fd < fdsCap; ++fd) {
+			struct Session *session = sessions[fd];
+			if (!session || session->server != (int)fd) continue;
+			if (session->pid != pid) continue;
+			sessionClose(epoll, session);
+			break;
+		}
+	}
+}
+
+static void serve(int control) {
+	int epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll < 0) err(EX_OSERR, "epoll_create1");
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	int error = sigprocmask(SIG_BLOCK, &mask, NULL);
+	if (error) err(EX_OSERR, "sigprocmask");
+	int signals = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signals < 0) err(EX_OSERR, "signalfd");
+
+	fcntl(control, F_SETFL, O_NONBLOCK);
+	error = listen(control, SOMAXCONN);
+	if (error) err(EX_OSERR, "listen");
+	watch(epoll, control);
+	watch(epoll, signals);
+
+	struct epoll_event events[64];
+	for (;;) {
+		int nfds = epoll_wait(epoll, events, 64, -1);
+		if (nfds < 0) {
+			if (errno == EINTR) continue;
+			err(EX_IOERR, "epoll_wait");
+		}
+		for (int i = 0; i < nfds; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == control) {
+				sessionControl(epoll, control);
+			} else if (fd == signals) {
+				struct signalfd_siginfo info;
+				while (0 < read(signals, &info, sizeof(info))) {
+					if (info.ssi_signo == SIGCHLD) continue;
+					for (size_t fd = 0; fd < fdsCap; ++fd) {
+						struct Session *session = sessions[fd];
+						if (!session || session->server != (int)fd) continue;
+						unlink(session->addr.sun_path);
+					}
+					unlink(addr.sun_path);
+					_exit(-info.ssi_signo);
+				}
+				sessionReap(epoll);
+			} else if ((size_t)fd < fdsCap && conns[fd]) {
+				connEvent(epoll, fd);
+			} else if ((size_t)fd < fdsCap && sessions[fd]) {
+				sessionEvent(epoll, sessions[fd], fd);
+			}
+		}
+	}
+}
+
+static void create(
+	int sock, bool sink, size_t logSize, const char *name, char *argv[]
+) {
+	int dir = open(".", O_RDONLY | O_DIRECTORY);
+	if (dir < 0) err(EX_NOINPUT, ".");
+	ssize_t len = sendfd(sock, dir, 0);
+	if (len < 0) err(EX_IOERR, "sendfd");
+	close(dir);
+
+	FILE *req = fdopen(sock, "r+");
+	if (!req) err(EX_OSERR, "fdopen");
+	fprintf(req, "%s%c%s", name, 0, (sink ? "s" : ""));
+	if (logSize) fprintf(req, "b%zu", logSize);
+	fputc(0, req);
+	for (char **arg = argv; *arg; ++arg) {
+		fprintf(req, "%s%c", *arg, 0);
+	}
+	fputc(0, req);
+	for (char **env = environ; *env; ++env) {
+		fprintf(req, "%s%c", *env, 0);
+	}
+	fflush(req);
+	if (ferror(req)) err(EX_IOERR, "%s", addr.sun_path);
+	shutdown(sock, SHUT_WR);
+
+	char reply[256];
+	size_t n = fread(reply, 1, sizeof(reply) - 1, req);
+	if (!n) errx(EX_PROTOCOL, "%s: no reply", addr.sun_path);
+	reply[n] = '\0';
+	if (reply[0] != EX_OK) errx(reply[0], "%s: %s", name, &reply[1]);
+}
+
+#else
+
+static void serve(int control) {
+	(void)control;
+	errx(EX_CONFIG, "daemon mode requires epoll");
+}
+
+static void create(
+	int sock, bool sink, size_t logSize, const char *name, char *argv[]
+) {
+	(void)sock;
+	(void)sink;
+	(void)logSize;
+	(void)argv;
+	errx(EX_CONFIG, "%s: daemon mode requires epoll", name);
+}
+
+#endif
+
 static struct termios saveTerm;
 static void restoreTerm(void) {
 	tcsetattr(STDIN_FILENO, TCSADRAIN, &saveTerm);
@@ -153,20 +822,54 @@ static void nop(int sig) {
 static void attach(int client) {
 	int error;
 
-	int pty = recvfd(client);
+	char version;
+	int pty = recvfd(client, &version);
 	if (pty < 0) err(EX_IOERR, "recvfd");
 	warnx("attached");
 
-	struct winsize window;
+	// Output is only mirrored to sessions which keep a screen.
+	char buf[4096];
+	size_t len = 0;
+	ssize_t n;
+	bool mirror = (version == ScreenVersion);
+	if (mirror) {
+		n = send(client, &version, 1, MSG_NOSIGNAL);
+		if (n < 0) err(EX_IOERR, "send");
+		char magic[sizeof(ScreenMagic)];
+		n = recv(client, magic, sizeof(magic), MSG_WAITALL);
+		if (n < 0) err(EX_IOERR, "recv");
+		if (
+			n < (ssize_t)sizeof(magic) ||
+			memcmp(magic, ScreenMagic, sizeof(magic))
+		) {
+			errx(EX_PROTOCOL, "invalid screen");
+		}
+		n = recv(client, &len, sizeof(len), MSG_WAITALL);
+		if (n < 0) err(EX_IOERR, "recv");
+		if (n < (ssize_t)sizeof(len)) errx(EX_PROTOCOL, "screen truncated");
+	}
+	while (len) {
+		n = recv(client, buf, (len < sizeof(buf) ? len : sizeof(buf)), 0);
+		if (n < 0) err(EX_IOERR, "recv");
+		if (!n) errx(EX_PROTOCOL, "screen truncated");
+		if (!fwrite(buf, n, 1, stdout)) err(EX_IOERR, "(stdout)");
+		len -= n;
+	}
+	fflush(stdout);
+
+	// The screen is drawn at the size of the pty, so only resize it if the
+	// window differs, letting the application redraw.
+	struct winsize window, prev;
 	error = ioctl(STDIN_FILENO, TIOCGWINSZ, &window);
 	if (error) err(EX_IOERR, "ioctl");
 
-	struct winsize redraw = { .ws_row = 1, .ws_col = 1 };
-	error = ioctl(pty, TIOCSWINSZ, &redraw);
+	error = ioctl(pty, TIOCGWINSZ, &prev);
 	if (error) err(EX_IOERR, "ioctl");
 
-	error = ioctl(pty, TIOCSWINSZ, &window);
-	if (error) err(EX_IOERR, "ioctl");
+	if (window.ws_row != prev.ws_row || window.ws_col != prev.ws_col) {
+		error = ioctl(pty, TIOCSWINSZ, &window);
+		if (error) err(EX_IOERR, "ioctl");
+	}
 
 	error = tcgetattr(STDIN_FILENO, &saveTerm);
 	if (error) err(EX_IOERR, "tcgetattr");
@@ -179,7 +882,6 @@ static void attach(int client) {
 
 	signal(SIGWINCH, nop);
 
-	char buf[4096];
 	struct pollfd fds[] = {
 		{ .events = POLLIN, .fd = STDIN_FILENO },
 		{ .events = POLLIN, .fd = pty },
@@ -214,35 +916,56 @@ static void attach(int client) {
 			if (len < 0) err(EX_IOERR, "read");
 			if (!len) break;
 
-			len = write(STDOUT_FILENO, buf, len);
-			if (len < 0) err(EX_IOERR, "write");
+			for (ssize_t out = 0; out < len; out += n) {
+				n = write(STDOUT_FILENO, &buf[out], len - out);
+				if (n < 0) err(EX_IOERR, "write");
+			}
+
+			if (!mirror) continue;
+			n = send(client, buf, len, MSG_NOSIGNAL);
+			if (n < 0) err(EX_IOERR, "send");
 		}
 	}
 }
 
 int main(int argc, char *argv[]) {
+	setlocale(LC_CTYPE, "");
+
 	int error;
 
 	bool atch = false;
+	bool dmon = false;
+	bool request = false;
 	bool sink = false;
+	size_t logSize = 0;
+	size_t tailLines = 0;
+	size_t tailBytes = 0;
 
 	int opt;
-	while (0 < (opt = getopt(argc, argv, "as"))) {
+	while (0 < (opt = getopt(argc, argv, "N:ab:cdn:s"))) {
 		switch (opt) {
+			break; case 'N': tailBytes = parseSize(optarg);
 			break; case 'a': atch = true;
+			break; case 'b': logSize = parseSize(optarg); sink = true;
+			break; case 'c': request = true;
+			break; case 'd': dmon = true;
+			break; case 'n': tailLines = strtoull(optarg, NULL, 10);
 			break; case 's': sink = true;
 			break; default:  return EX_USAGE;
 		}
 	}
-	if (optind == argc) errx(EX_USAGE, "no session name");
-	const char *name = argv[optind++];
+	const char *name = ".daemon";
+	if (!dmon) {
+		if (optind == argc) errx(EX_USAGE, "no session name");
+		name = argv[optind++];
+	}
 
 	if (optind == argc) {
 		argv[--optind] = getenv("SHELL");
 		if (!argv[optind]) errx(EX_CONFIG, "SHELL unset");
 	}
 
-	const char *home = getenv("HOME");
+	home = getenv("HOME");
 	if (!home) errx(EX_CONFIG, "HOME unset");
 
 	int fd = open(home, 0);
@@ -259,13 +982,29 @@ int main(int argc, char *argv[]) {
 
 	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/.dtch/%s", home, name);
 
+	if (tailLines || tailBytes) {
+		logTail(addr.sun_path, tailLines, tailBytes);
+		if (!atch) return EX_OK;
+	}
+
 	if (atch) {
 		error = connect(sock, (struct sockaddr *)&addr, SUN_LEN(&addr));
 		if (error) err(EX_NOINPUT, "%s", addr.sun_path);
 		attach(sock);
+	} else if (request) {
+		snprintf(
+			addr.sun_path, sizeof(addr.sun_path), "%s/.dtch/.daemon", home
+		);
+		error = connect(sock, (struct sockaddr *)&addr, SUN_LEN(&addr));
+		if (error) err(EX_UNAVAILABLE, "%s", addr.sun_path);
+		create(sock, sink, logSize, name, &argv[optind]);
+	} else if (dmon) {
+		error = bind(sock, (struct sockaddr *)&addr, SUN_LEN(&addr));
+		if (error) err(EX_CANTCREAT, "%s", addr.sun_path);
+		serve(sock);
 	} else {
 		error = bind(sock, (struct sockaddr *)&addr, SUN_LEN(&addr));
 		if (error) err(EX_CANTCREAT, "%s", addr.sun_path);
-		detach(sock, sink, &argv[optind]);
+		detach(sock, sink, logSize, &argv[optind]);
 	}
 }
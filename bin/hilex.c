@@ -17,16 +17,22 @@
 #include <assert.h>
 #include <ctype.h>
 #include <err.h>
+#include <fcntl.h>
 #include <regex.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include <sys/wait.h>
 #include <sysexits.h>
 #include <unistd.h>
 
 #include "hilex.h"
+#include "tags.h"
 
 #define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
 
@@ -36,13 +42,30 @@ static const char *Class[] = {
 #undef X
 };
 
-static FILE *yyin;
 static char *yytext;
+static size_t yyleng;
+static char *yyend;
+static void yyscan(char *buf, size_t len) {
+	yytext = buf;
+	yyleng = 0;
+	yyend = &buf[len];
+}
 static int yylex(void) {
-	static size_t cap = 0;
-	return (getline(&yytext, &cap, yyin) < 0 ? None : Normal);
+	yytext += yyleng;
+	if (yytext == yyend) return None;
+	char *nl = memchr(yytext, '\n', yyend - yytext);
+	yyleng = (nl ? &nl[1] : yyend) - yytext;
+	return Normal;
+}
+static size_t yylen(void) {
+	return yyleng;
+}
+static bool yysync(void) {
+	return true;
 }
-static const struct Lexer LexText = { yylex, &yyin, &yytext };
+static const struct Lexer LexText = {
+	yyscan, yylex, &yytext, yylen, yysync
+};
 
 static const struct {
 	const struct Lexer *lexer;
@@ -57,23 +80,22 @@ static const struct {
 	{ &LexText, "text", "[.]txt$", NULL },
 };
 
-static const struct Lexer *parseLexer(const char *name) {
+static const char *lexerName(const struct Lexer *lexer) {
 	for (size_t i = 0; i < ARRAY_LEN(Lexers); ++i) {
-		if (!strcmp(name, Lexers[i].name)) return Lexers[i].lexer;
+		if (lexer == Lexers[i].lexer) return Lexers[i].name;
 	}
-	errx(EX_USAGE, "unknown lexer %s", name);
+	return NULL;
 }
 
-static void ungets(const char *str, FILE *file) {
-	size_t len = strlen(str);
-	for (size_t i = len-1; i < len; --i) {
-		int ch = ungetc(str[i], file);
-		if (ch == EOF) errx(EX_IOERR, "cannot push back string");
+static const struct Lexer *parseLexer(const char *name) {
+	for (size_t i = 0; i < ARRAY_LEN(Lexers); ++i) {
+		if (!strcmp(name, Lexers[i].name)) return Lexers[i].lexer;
 	}
+	errx(EX_USAGE, "unknown lexer %s", name);
 }
 
-static const struct Lexer *matchLexer(const char *name, FILE *file) {
-	char buf[256];
+static const struct Lexer *
+matchLexer(const char *name, const char *buf, size_t len) {
 	regex_t regex;
 	for (size_t i = 0; i < ARRAY_LEN(Lexers); ++i) {
 		int error = regcomp(
@@ -84,8 +106,13 @@ static const struct Lexer *matchLexer(const char *name, FILE *file) {
 		regfree(&regex);
 		if (!error) return Lexers[i].lexer;
 	}
-	char *line = fgets(buf, sizeof(buf), file);
-	if (!line) return NULL;
+	if (!len) return NULL;
+	char line[256];
+	const char *nl = memchr(buf, '\n', len);
+	if (nl) len = &nl[1] - buf;
+	if (len > sizeof(line) - 1) len = sizeof(line) - 1;
+	memcpy(line, buf, len);
+	line[len] = '\0';
 	for (size_t i = 0; i < ARRAY_LEN(Lexers); ++i) {
 		if (!Lexers[i].linePatt) continue;
 		int error = regcomp(
@@ -94,15 +121,54 @@ static const struct Lexer *matchLexer(const char *name, FILE *file) {
 		assert(!error);
 		error = regexec(&regex, line, 0, NULL, 0);
 		regfree(&regex);
-		if (!error) {
-			ungets(line, file);
-			return Lexers[i].lexer;
-		}
+		if (!error) return Lexers[i].lexer;
 	}
-	ungets(line, file);
 	return NULL;
 }
 
+// Map regular files, with an anonymous page behind them in case they end
+// on a page boundary, so the trailing NULs are always there to be found.
+static char *mapInput(int fd, size_t len) {
+	char *buf = mmap(
+		NULL, len + 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0
+	);
+	if (buf == MAP_FAILED) err(EX_OSERR, "mmap");
+	char *map = mmap(
+		buf, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0
+	);
+	if (map == MAP_FAILED) {
+		munmap(buf, len + 2);
+		return NULL;
+	}
+	return buf;
+}
+
+static char *readInput(int fd, size_t *len) {
+	struct stat st;
+	int error = fstat(fd, &st);
+	if (error) err(EX_IOERR, "fstat");
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		*len = st.st_size;
+		char *buf = mapInput(fd, *len);
+		if (buf) return buf;
+	}
+
+	*len = 0;
+	size_t cap = 64 * 1024;
+	char *buf = malloc(cap);
+	if (!buf) err(EX_OSERR, "malloc");
+	ssize_t n;
+	while (0 < (n = read(fd, &buf[*len], cap - *len - 2))) {
+		*len += n;
+		if (*len + 2 < cap) continue;
+		buf = realloc(buf, (cap *= 2));
+		if (!buf) err(EX_OSERR, "realloc");
+	}
+	if (n < 0) err(EX_IOERR, "read");
+	buf[*len] = buf[*len + 1] = '\0';
+	return buf;
+}
+
 #define ENUM_OPTION \
 	X(Document, "document") \
 	X(Inline, "inline") \
@@ -110,6 +176,7 @@ static const struct Lexer *matchLexer(const char *name, FILE *file) {
 	X(Pre, "pre") \
 	X(Style, "style") \
 	X(Tab, "tab") \
+	X(Tags, "tags") \
 	X(Title, "title")
 
 enum Option {
@@ -120,11 +187,103 @@ enum Option {
 };
 
 typedef void Header(const char *opts[]);
-typedef void Output(const char *opts[], enum Class class, const char *text);
+typedef void Output(
+	const char *opts[], enum Class class, const char *text, size_t len
+);
+
+static struct {
+	char buf[64 * 1024];
+	size_t len;
+	size_t sent;
+	FILE *tee;
+} out;
+
+static void emit(const char *ptr, size_t len) {
+	if (!len) return;
+	fwrite(ptr, len, 1, stdout);
+	if (out.tee) fwrite(ptr, len, 1, out.tee);
+	out.sent += len;
+}
+
+static void flush(void) {
+	emit(out.buf, out.len);
+	out.len = 0;
+}
+
+static void put(const char *ptr, size_t len) {
+	if (out.len + len > sizeof(out.buf)) {
+		flush();
+		if (len > sizeof(out.buf)) {
+			emit(ptr, len);
+			return;
+		}
+	}
+	memcpy(&out.buf[out.len], ptr, len);
+	out.len += len;
+}
+
+static void putStr(const char *str) {
+	put(str, strlen(str));
+}
+
+static void putf(const char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(
+		&out.buf[out.len], sizeof(out.buf) - out.len, format, ap
+	);
+	va_end(ap);
+	assert(len >= 0);
+	if ((size_t)len >= sizeof(out.buf) - out.len) {
+		flush();
+		va_start(ap, format);
+		len = vsnprintf(out.buf, sizeof(out.buf), format, ap);
+		va_end(ap);
+		assert((size_t)len < sizeof(out.buf));
+	}
+	out.len += len;
+}
+
+// Open and close strings for each class, set up by the formatter header:
+static struct Span {
+	char open[64];
+	char close[16];
+	size_t openLen;
+	size_t closeLen;
+} Spans[ClassCap];
+
+static void span(enum Class class, const char *close, const char *format, ...) {
+	struct Span *span = &Spans[class];
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(span->open, sizeof(span->open), format, ap);
+	va_end(ap);
+	assert(len >= 0 && (size_t)len < sizeof(span->open));
+	span->openLen = len;
+	span->closeLen = strlen(close);
+	assert(span->closeLen < sizeof(span->close));
+	memcpy(span->close, close, span->closeLen + 1);
+}
+
+static const char *SGR[ClassCap] = {
+	[Keyword] = "37",
+	[Macro]   = "32",
+	[Comment] = "34",
+	[String]  = "36",
+	[Format]  = "36;1;96",
+	[Subst]   = "33",
+};
+
+static void ansiSpans(void) {
+	for (enum Class class = 0; class < ClassCap; ++class) {
+		if (SGR[class]) span(class, "\33[m", "\33[%sm", SGR[class]);
+	}
+}
 
 static bool pager;
 static void ansiHeader(const char *opts[]) {
 	(void)opts;
+	ansiSpans();
 	if (!pager) return;
 	const char *shell = getenv("SHELL");
 	const char *pager = getenv("PAGER");
@@ -155,40 +314,50 @@ static void ansiFooter(const char *opts[]) {
 	(void)opts;
 	if (!pager) return;
 	int status;
+	flush();
 	fclose(stdout);
 	wait(&status);
 }
 
-static const char *SGR[ClassCap] = {
-	[Keyword] = "37",
-	[Macro]   = "32",
-	[Comment] = "34",
-	[String]  = "36",
-	[Format]  = "36;1;96",
-	[Subst]   = "33",
-};
-
-static void ansiFormat(const char *opts[], enum Class class, const char *text) {
+static void ansiFormat(
+	const char *opts[], enum Class class, const char *text, size_t len
+) {
 	(void)opts;
-	if (!SGR[class]) {
-		printf("%s", text);
+	const struct Span *span = &Spans[class];
+	if (!span->openLen) {
+		put(text, len);
 		return;
 	}
 	// Set color on each line for piping to less -R:
-	for (const char *nl; (nl = strchr(text, '\n')); text = &nl[1]) {
-		printf("\33[%sm%.*s\33[m\n", SGR[class], (int)(nl - text), text);
+	for (const char *nl; (nl = memchr(text, '\n', len));) {
+		put(span->open, span->openLen);
+		put(text, nl - text);
+		put(span->close, span->closeLen);
+		put("\n", 1);
+		len -= &nl[1] - text;
+		text = &nl[1];
 	}
-	if (*text) printf("\33[%sm%s\33[m", SGR[class], text);
+	if (!len) return;
+	put(span->open, span->openLen);
+	put(text, len);
+	put(span->close, span->closeLen);
+}
+
+static void debugHeader(const char *opts[]) {
+	(void)opts;
+	ansiSpans();
 }
 
-static void
-debugFormat(const char *opts[], enum Class class, const char *text) {
+static void debugFormat(
+	const char *opts[], enum Class class, const char *text, size_t len
+) {
 	if (class != Normal) {
-		printf("%s(", Class[class]);
-		ansiFormat(opts, class, text);
-		printf(")");
+		putStr(Class[class]);
+		put("(", 1);
+		ansiFormat(opts, class, text, len);
+		put(")", 1);
 	} else {
-		printf("%s", text);
+		put(text, len);
 	}
 }
 
@@ -202,42 +371,68 @@ static const char *IRC[ClassCap] = {
 };
 
 static void ircHeader(const char *opts[]) {
-	if (opts[Monospace]) printf("\21");
+	for (enum Class class = 0; class < ClassCap; ++class) {
+		if (!IRC[class]) continue;
+		span(class, (opts[Monospace] ? "\17\21" : "\17"), "%s", IRC[class]);
+	}
+	if (opts[Monospace]) put("\21", 1);
 }
 
 static const char *stop(const char *text) {
 	return (*text == ',' || isdigit(*text) ? "\2\2" : "");
 }
 
-static void ircFormat(const char *opts[], enum Class class, const char *text) {
-	for (const char *nl; (nl = strchr(text, '\n')); text = &nl[1]) {
-		if (IRC[class]) printf("%s%s", IRC[class], stop(text));
-		printf("%.*s\n", (int)(nl - text), text);
-		if (opts[Monospace]) printf("\21");
-	}
-	if (*text) {
-		if (IRC[class]) {
-			printf("%s%s%s\17", IRC[class], stop(text), text);
-			if (opts[Monospace]) printf("\21");
-		} else {
-			printf("%s", text);
+static void ircFormat(
+	const char *opts[], enum Class class, const char *text, size_t len
+) {
+	const struct Span *span = &Spans[class];
+	for (const char *nl; (nl = memchr(text, '\n', len));) {
+		if (span->openLen) {
+			put(span->open, span->openLen);
+			putStr(stop(text));
 		}
+		put(text, &nl[1] - text);
+		if (opts[Monospace]) put("\21", 1);
+		len -= &nl[1] - text;
+		text = &nl[1];
+	}
+	if (!len) return;
+	if (span->openLen) {
+		put(span->open, span->openLen);
+		putStr(stop(text));
+		put(text, len);
+		put(span->close, span->closeLen);
+	} else {
+		put(text, len);
 	}
 }
 
-static void htmlEscape(const char *text) {
-	while (*text) {
-		switch (*text) {
-			break; case '"': text++; printf("&quot;");
-			break; case '&': text++; printf("&amp;");
-			break; case '<': text++; printf("&lt;");
-		}
-		size_t len = strcspn(text, "\"&<");
-		if (len) fwrite(text, len, 1, stdout);
-		text += len;
+static const struct {
+	const char *str;
+	size_t len;
+} HTMLEscapes[256] = {
+	['"'] = { "&quot;", 6 },
+	['&'] = { "&amp;", 5 },
+	['<'] = { "&lt;", 4 },
+};
+
+static void htmlEscape(const char *text, size_t len) {
+	const char *end = &text[len];
+	while (text < end) {
+		const char *ptr = text;
+		while (ptr < end && !HTMLEscapes[(unsigned char)*ptr].len) ptr++;
+		put(text, ptr - text);
+		if (ptr == end) break;
+		unsigned char ch = *ptr;
+		put(HTMLEscapes[ch].str, HTMLEscapes[ch].len);
+		text = &ptr[1];
 	}
 }
 
+static void htmlEscapeStr(const char *str) {
+	htmlEscape(str, strlen(str));
+}
+
 static const char *Styles[ClassCap] = {
 	[Keyword] = "color: dimgray;",
 	[Macro]   = "color: green;",
@@ -248,64 +443,186 @@ static const char *Styles[ClassCap] = {
 };
 
 static void styleTabSize(const char *tab) {
-	printf("-moz-tab-size: ");
-	htmlEscape(tab);
-	printf("; tab-size: ");
-	htmlEscape(tab);
-	printf(";");
+	putStr("-moz-tab-size: ");
+	htmlEscapeStr(tab);
+	putStr("; tab-size: ");
+	htmlEscapeStr(tab);
+	putStr(";");
 }
 
 static void htmlHeader(const char *opts[]) {
+	for (enum Class class = 0; class < ClassCap; ++class) {
+		if (class == Normal) continue;
+		if (opts[Inline]) {
+			span(
+				class, "</span>", "<span style=\"%s\">",
+				(Styles[class] ? Styles[class] : "")
+			);
+		} else {
+			span(class, "</span>", "<span class=\"%.2s\">", Class[class]);
+		}
+	}
 	if (!opts[Document]) goto body;
 
-	printf("<!DOCTYPE html>\n<title>");
-	if (opts[Title]) htmlEscape(opts[Title]);
-	printf("</title>\n");
+	putStr("<!DOCTYPE html>\n<title>");
+	if (opts[Title]) htmlEscapeStr(opts[Title]);
+	putStr("</title>\n");
 
 	if (opts[Style]) {
-		printf("<link rel=\"stylesheet\" href=\"");
-		htmlEscape(opts[Style]);
-		printf("\">\n");
+		putStr("<link rel=\"stylesheet\" href=\"");
+		htmlEscapeStr(opts[Style]);
+		putStr("\">\n");
 	} else if (!opts[Inline]) {
-		printf("<style>\n");
+		putStr("<style>\n");
 		if (opts[Tab]) {
-			printf("pre.hilex { ");
+			putStr("pre.hilex { ");
 			styleTabSize(opts[Tab]);
-			printf(" }\n");
+			putStr(" }\n");
 		}
 		for (enum Class class = 0; class < ClassCap; ++class) {
 			if (!Styles[class]) continue;
-			printf("pre.hilex .%.2s { %s }\n", Class[class], Styles[class]);
+			putf("pre.hilex .%.2s { %s }\n", Class[class], Styles[class]);
 		}
-		printf("</style>\n");
+		putStr("</style>\n");
 	}
 
 body:
 	if ((opts[Document] || opts[Pre]) && opts[Inline] && opts[Tab]) {
-		printf("<pre class=\"hilex\" style=\"");
+		putStr("<pre class=\"hilex\" style=\"");
 		styleTabSize(opts[Tab]);
-		printf("\">");
+		putStr("\">");
 	} else if (opts[Document] || opts[Pre]) {
-		printf("<pre class=\"hilex\">");
+		putStr("<pre class=\"hilex\">");
 	}
 }
 
 static void htmlFooter(const char *opts[]) {
-	if (opts[Document] || opts[Pre]) printf("</pre>");
-	if (opts[Document]) printf("\n");
+	if (opts[Document] || opts[Pre]) putStr("</pre>");
+	if (opts[Document]) putStr("\n");
 }
 
-static void htmlFormat(const char *opts[], enum Class class, const char *text) {
-	if (class != Normal) {
-		if (opts[Inline]) {
-			printf("<span style=\"%s\">", Styles[class] ? Styles[class] : "");
-		} else {
-			printf("<span class=\"%.2s\">", Class[class]);
+// Tags are anchored as by htagml(1), inside the span of the token they are
+// found in, or around the spans of the tokens they start and end.
+static const char *input;
+static size_t anchor;
+static size_t anchorsLen;
+static struct Anchor {
+	size_t start;
+	size_t end;
+	const char *tag;
+} *anchors;
+
+static void anchorTags(const char *buf, size_t len) {
+	size_t cap = 0;
+	char *line = NULL;
+	size_t lineCap = 0;
+	int num = 0;
+	for (size_t pos = 0; pos < len; ++num) {
+		const char *nl = memchr(&buf[pos], '\n', len - pos);
+		size_t n = (nl ? (size_t)(nl - &buf[pos]) + 1 : len - pos);
+		if (lineCap < n + 1) {
+			line = realloc(line, (lineCap = n + 1));
+			if (!line) err(EX_OSERR, "realloc");
 		}
-		htmlEscape(text);
-		printf("</span>");
-	} else {
-		htmlEscape(text);
+		memcpy(line, &buf[pos], n);
+		line[n] = '\0';
+
+		const char *tag = tagsMatch(num + 1, line, n);
+		if (!tag) {
+			pos += n;
+			continue;
+		}
+		size_t mlen = strlen(tag);
+		const char *match = strstr(line, tag);
+		while (match > line && isalnum(match[-1])) {
+			match = strstr(&match[mlen], tag);
+		}
+		if (!match && tag[0] == 'M') {
+			mlen = 4;
+			match = strstr(line, "main");
+		}
+		if (!match) {
+			mlen = n - 1;
+			match = line;
+		}
+		if (anchorsLen == cap) {
+			cap = (cap ? cap * 2 : 64);
+			anchors = realloc(anchors, cap * sizeof(*anchors));
+			if (!anchors) err(EX_OSERR, "realloc");
+		}
+		size_t start = pos + (match - line);
+		anchors[anchorsLen++] = (struct Anchor) { start, start + mlen, tag };
+		pos += n;
+	}
+	free(line);
+}
+
+static void htmlId(const char *tag) {
+	for (const char *ch = tag; *ch; ++ch) {
+		char id = (isalnum(*ch) || strchr("-._", *ch) ? *ch : '_');
+		put(&id, 1);
+	}
+}
+
+static void htmlAnchor(const struct Anchor *anchor) {
+	putStr("<a class=\"tag\" id=\"");
+	htmlId(anchor->tag);
+	putStr("\" href=\"#");
+	htmlId(anchor->tag);
+	putStr("\">");
+}
+
+static void htmlFormat(
+	const char *opts[], enum Class class, const char *text, size_t len
+) {
+	(void)opts;
+	const struct Span *span = &Spans[class];
+	if (!anchorsLen) {
+		put(span->open, span->openLen);
+		htmlEscape(text, len);
+		put(span->close, span->closeLen);
+		return;
+	}
+
+	size_t start = text - input;
+	size_t pos = start, end = start + len;
+	while (anchor < anchorsLen && anchors[anchor].end < pos) anchor++;
+	const struct Anchor *a = (anchor < anchorsLen ? &anchors[anchor] : NULL);
+	bool outer = (a && a->start == pos && a->end > end);
+	if (outer) htmlAnchor(a);
+	put(span->open, span->openLen);
+	while (!outer && a && a->start >= pos && a->start < end) {
+		size_t stop = (a->end < end ? a->end : end);
+		htmlEscape(&input[pos], a->start - pos);
+		htmlAnchor(a);
+		htmlEscape(&input[a->start], stop - a->start);
+		putStr("</a>");
+		pos = stop;
+		a = (++anchor < anchorsLen ? &anchors[anchor] : NULL);
+	}
+	htmlEscape(&input[pos], end - pos);
+	put(span->close, span->closeLen);
+	if (a && a->start < start && a->end <= end) {
+		putStr("</a>");
+		anchor++;
+	}
+}
+
+static size_t Counts[ClassCap];
+
+static void countFormat(
+	const char *opts[], enum Class class, const char *text, size_t len
+) {
+	(void)opts;
+	(void)text;
+	(void)len;
+	Counts[class]++;
+}
+
+static void countFooter(const char *opts[]) {
+	(void)opts;
+	for (enum Class class = 0; class < ClassCap; ++class) {
+		if (Counts[class]) putf("%s %zu\n", Class[class], Counts[class]);
 	}
 }
 
@@ -316,7 +633,8 @@ static const struct Formatter {
 	Header *footer;
 } Formatters[] = {
 	{ "ansi", ansiHeader, ansiFormat, ansiFooter },
-	{ "debug", NULL, debugFormat, NULL },
+	{ "count", NULL, countFormat, countFooter },
+	{ "debug", debugHeader, debugFormat, NULL },
 	{ "html", htmlHeader, htmlFormat, htmlFooter },
 	{ "irc", ircHeader, ircFormat, NULL },
 };
@@ -328,6 +646,184 @@ static const struct Formatter *parseFormatter(const char *name) {
 	errx(EX_USAGE, "unknown formatter %s", name);
 }
 
+typedef bool Stop(size_t pos);
+
+// Format tokens from pos, and if stop is set, return the first offset after a
+// line break where the lexer is synced and stop returns true.
+static size_t lex(
+	const struct Lexer *lexer, const struct Formatter *formatter,
+	const char *opts[], char *buf, size_t len, size_t pos, Stop *stop
+) {
+	lexer->scan(&buf[pos], len - pos);
+	for (enum Class class; None != (class = lexer->lex());) {
+		assert(class < ClassCap);
+		const char *text = *lexer->text;
+		size_t tlen = lexer->len();
+		formatter->format(opts, class, text, tlen);
+		if (!stop || text[tlen-1] != '\n' || !lexer->sync()) continue;
+		pos = &text[tlen] - buf;
+		if (stop(pos)) return pos;
+	}
+	return len;
+}
+
+// Input is split into chunks at line breaks, each formatted by a child
+// process into a temporary file. A chunk's child continues past its end to
+// the first offset at which its lexer is synced, and marks where it was
+// synced along the way, so that output can be stitched together wherever a
+// child and the lexer of the preceding input agree on being synced. Marks are
+// only made at line breaks before the next chunk, so there is room for all.
+static struct {
+	size_t len;
+	struct Chunk {
+		size_t start;
+		size_t next;
+		size_t end;
+		size_t marks;
+		struct Mark {
+			size_t in;
+			size_t out;
+		} *mark;
+	} *ptr;
+	FILE **files;
+	pid_t *pids;
+} chunks;
+
+static size_t lines(const char *buf, size_t len) {
+	size_t n = 0;
+	for (const char *nl = buf; (nl = memchr(nl, '\n', &buf[len] - nl)); ++nl) {
+		n++;
+	}
+	return n;
+}
+
+static struct Chunk *chunk;
+static bool markChunk(size_t pos) {
+	if (pos >= chunk->next) return true;
+	chunk->mark[chunk->marks++] = (struct Mark) { pos, out.sent + out.len };
+	return false;
+}
+
+static void waitChunk(size_t i) {
+	if (!chunks.pids[i]) return;
+	int status;
+	pid_t pid = waitpid(chunks.pids[i], &status, 0);
+	if (pid < 0) err(EX_OSERR, "waitpid");
+	chunks.pids[i] = 0;
+	if (WIFSIGNALED(status)) {
+		errx(EX_SOFTWARE, "chunk %zu: signal %d", i, WTERMSIG(status));
+	}
+	if (WEXITSTATUS(status)) exit(WEXITSTATUS(status));
+}
+
+static bool findMark(size_t pos, size_t *index, size_t *offset) {
+	size_t i = chunks.len - 1;
+	while (chunks.ptr[i].start > pos) i--;
+	waitChunk(i);
+	const struct Chunk *chunk = &chunks.ptr[i];
+	for (size_t j = 0; j < chunk->marks; ++j) {
+		if (chunk->mark[j].in != pos) continue;
+		*index = i;
+		*offset = chunk->mark[j].out;
+		return true;
+	}
+	return false;
+}
+
+static bool resumable(size_t pos) {
+	size_t index, offset;
+	return findMark(pos, &index, &offset);
+}
+
+static void copyChunk(size_t i, size_t offset) {
+	char buf[64 * 1024];
+	FILE *file = chunks.files[i];
+	int error = fseeko(file, offset, SEEK_SET);
+	if (error) err(EX_IOERR, "fseeko");
+	for (size_t n; 0 < (n = fread(buf, 1, sizeof(buf), file));) {
+		put(buf, n);
+	}
+	if (ferror(file)) err(EX_IOERR, "fread");
+	fclose(file);
+	chunks.files[i] = NULL;
+}
+
+static void lexChunks(
+	const struct Lexer *lexer, const struct Formatter *formatter,
+	const char *opts[], char *buf, size_t len, size_t jobs
+) {
+	chunks.ptr = mmap(
+		NULL, jobs * sizeof(*chunks.ptr),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0
+	);
+	if (chunks.ptr == MAP_FAILED) err(EX_OSERR, "mmap");
+	chunks.files = calloc(jobs, sizeof(*chunks.files));
+	chunks.pids = calloc(jobs, sizeof(*chunks.pids));
+	if (!chunks.files || !chunks.pids) err(EX_OSERR, "calloc");
+
+	chunks.len = 0;
+	for (size_t i = 0; i < jobs; ++i) {
+		size_t start = 0;
+		if (i) {
+			size_t split = i * len / jobs;
+			const char *nl = memchr(&buf[split], '\n', len - split);
+			if (!nl) break;
+			start = &nl[1] - buf;
+		}
+		if (start == len) break;
+		if (chunks.len && start <= chunks.ptr[chunks.len-1].start) continue;
+		if (chunks.len) chunks.ptr[chunks.len-1].next = start;
+		chunks.ptr[chunks.len++] = (struct Chunk) { .start = start, .next = len };
+	}
+
+	struct Mark *marks = mmap(
+		NULL, (chunks.len + lines(buf, len)) * sizeof(*marks),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0
+	);
+	if (marks == MAP_FAILED) err(EX_OSERR, "mmap");
+	for (size_t i = 0; i < chunks.len; ++i) {
+		size_t start = chunks.ptr[i].start;
+		chunks.ptr[i].mark = marks;
+		marks += 1 + lines(&buf[start], chunks.ptr[i].next - start);
+	}
+
+	flush();
+	fflush(stdout);
+	for (size_t i = 0; i < chunks.len; ++i) {
+		chunks.files[i] = tmpfile();
+		if (!chunks.files[i]) err(EX_CANTCREAT, "tmpfile");
+		chunks.pids[i] = fork();
+		if (chunks.pids[i] < 0) err(EX_OSERR, "fork");
+		if (chunks.pids[i]) continue;
+
+		dup2(fileno(chunks.files[i]), STDOUT_FILENO);
+		out.sent = 0;
+		out.tee = NULL;
+		chunk = &chunks.ptr[i];
+		chunk->mark[chunk->marks++] = (struct Mark) { chunk->start, 0 };
+		chunk->end = lex(
+			lexer, formatter, opts, buf, len, chunk->start, markChunk
+		);
+		flush();
+		exit(EX_OK);
+	}
+
+	size_t pos = 0;
+	while (pos < len) {
+		size_t i, offset;
+		if (findMark(pos, &i, &offset)) {
+			copyChunk(i, offset);
+			pos = chunks.ptr[i].end;
+		} else {
+			pos = lex(lexer, formatter, opts, buf, len, pos, resumable);
+		}
+	}
+	for (size_t i = 0; i < chunks.len; ++i) {
+		waitChunk(i);
+		if (chunks.files[i]) fclose(chunks.files[i]);
+	}
+}
+
 static char *const OptionKeys[OptionCap + 1] = {
 #define X(option, key) [option] = key,
 	ENUM_OPTION
@@ -335,16 +831,59 @@ static char *const OptionKeys[OptionCap + 1] = {
 	NULL,
 };
 
+static char *cacheKey(
+	const struct Lexer *lexer, const struct Formatter *formatter,
+	const char *opts[], const char *tags, size_t tagsLen
+) {
+	char *key;
+	size_t len;
+	FILE *file = open_memstream(&key, &len);
+	if (!file) err(EX_OSERR, "open_memstream");
+	// Output changes with any part of hilex, after which hilex.o is rebuilt.
+	fprintf(
+		file, "%s %s %s", __DATE__ " " __TIME__,
+		lexerName(lexer), formatter->name
+	);
+	for (enum Option option = 0; option < OptionCap; ++option) {
+		if (!opts[option]) continue;
+		fprintf(
+			file, " %s=%zu:%s",
+			OptionKeys[option], strlen(opts[option]), opts[option]
+		);
+	}
+	if (tags) {
+		fprintf(file, " %zu:", tagsLen);
+		fwrite(tags, tagsLen, 1, file);
+	}
+	fclose(file);
+	return key;
+}
+
+static size_t parseSize(const char *str) {
+	static const char Units[] = "KMG";
+	char *end;
+	size_t size = strtoull(str, &end, 10);
+	if (!*end) return size;
+	const char *unit = strchr(Units, toupper(*end));
+	if (!unit || end[1]) errx(EX_USAGE, "invalid size %s", str);
+	return size << 10 * (unit - Units + 1);
+}
+
 int main(int argc, char *argv[]) {
 	bool text = false;
 	const char *name = NULL;
 	const struct Lexer *lexer = NULL;
 	const struct Formatter *formatter = &Formatters[0];
 	const char *opts[OptionCap] = {0};
+	size_t jobs = 1;
+	const char *cache = NULL;
+	size_t cacheMax = 64 << 20;
 
-	for (int opt; 0 < (opt = getopt(argc, argv, "f:l:n:o:t"));) {
+	for (int opt; 0 < (opt = getopt(argc, argv, "c:f:j:l:n:o:s:t"));) {
 		switch (opt) {
+			break; case 'c': cache = optarg;
 			break; case 'f': formatter = parseFormatter(optarg);
+			break; case 'j': jobs = strtoul(optarg, NULL, 10);
 			break; case 'l': lexer = parseLexer(optarg);
 			break; case 'n': name = optarg;
 			break; case 'o': {
@@ -355,19 +894,23 @@ int main(int argc, char *argv[]) {
 					opts[key] = (val ? val : "");
 				}
 			}
+			break; case 's': cacheMax = parseSize(optarg);
 			break; case 't': text = true;
 			break; default:  return EX_USAGE;
 		}
 	}
+	if (!jobs) return EX_USAGE;
 
 	const char *path = "(stdin)";
-	FILE *file = stdin;
+	int fd = STDIN_FILENO;
 	if (optind < argc) {
 		path = argv[optind];
-		file = fopen(path, "r");
-		if (!file) err(EX_NOINPUT, "%s", path);
+		fd = open(path, O_RDONLY);
+		if (fd < 0) err(EX_NOINPUT, "%s", path);
 		pager = isatty(STDOUT_FILENO);
 	}
+	size_t len;
+	char *buf = readInput(fd, &len);
 
 	if (!name) {
 		if (NULL != (name = strrchr(path, '/'))) {
@@ -377,15 +920,44 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	if (!opts[Title]) opts[Title] = name;
-	if (!lexer) lexer = matchLexer(name, file);
+	if (!lexer) lexer = matchLexer(name, buf, len);
 	if (!lexer && text) lexer = &LexText;
 	if (!lexer) errx(EX_USAGE, "cannot infer lexer for %s", name);
 
-	*lexer->in = file;
+	char *tags = NULL;
+	size_t tagsLen = 0;
+	if (opts[Tags] && formatter->format == htmlFormat) {
+		if (opts[Tags][0]) {
+			int tagsFd = open(opts[Tags], O_RDONLY);
+			if (tagsFd < 0) err(EX_NOINPUT, "%s", opts[Tags]);
+			tags = readInput(tagsFd, &tagsLen);
+			close(tagsFd);
+			tagsRead((optind < argc ? path : name), tags, tagsLen);
+		} else {
+			tagsScan(name, buf, len);
+		}
+		tagsIndex();
+		input = buf;
+		anchorTags(buf, len);
+	}
+
+	if (cache && !pager) {
+		char *key = cacheKey(lexer, formatter, opts, tags, tagsLen);
+		if (cacheHit(cache, key, buf, len)) return EX_OK;
+		free(key);
+		out.tee = cacheCreate();
+	}
+
+	// Counts stay in the chunk processes:
+	if (formatter->format == countFormat) jobs = 1;
+
 	if (formatter->header) formatter->header(opts);
-	for (enum Class class; None != (class = lexer->lex());) {
-		assert(class < ClassCap);
-		formatter->format(opts, class, *lexer->text);
+	if (jobs > 1) {
+		lexChunks(lexer, formatter, opts, buf, len, jobs);
+	} else {
+		lex(lexer, formatter, opts, buf, len, 0, NULL);
 	}
 	if (formatter->footer) formatter->footer(opts);
+	flush();
+	if (out.tee) cacheStore(out.tee, cacheMax);
 }
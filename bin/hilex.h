@@ -14,6 +14,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 
 #define ENUM_CLASS \
@@ -37,14 +39,25 @@ enum Class {
 	ClassCap,
 };
 
+// Input buffers are followed by two NULs, as required by yy_scan_buffer.
+typedef void Scan(char *buf, size_t len);
 typedef int Lex(void);
+typedef size_t Len(void);
+// Whether the scanner is back in the state it starts each scan in.
+typedef bool Sync(void);
 struct Lexer {
+	Scan *scan;
 	Lex *lex;
-	FILE **in;
 	char **text;
+	Len *len;
+	Sync *sync;
 };
 
 extern const struct Lexer LexC;
 extern const struct Lexer LexMake;
 extern const struct Lexer LexMdoc;
 extern const struct Lexer LexSh;
+
+bool cacheHit(const char *path, const char *key, const char *buf, size_t len);
+FILE *cacheCreate(void);
+void cacheStore(FILE *file, size_t max);
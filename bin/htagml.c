@@ -16,24 +16,249 @@
 
 #include <ctype.h>
 #include <err.h>
-#include <regex.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sysexits.h>
 #include <unistd.h>
 
-static char *nomagic(const char *pattern) {
-	char *buf = malloc(2 * strlen(pattern) + 1);
+#include "tags.h"
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+static const char *tagsBuf;
+static size_t tagsLen;
+
+static void readTags(const char *path, struct stat *st) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) err(EX_NOINPUT, "%s", path);
+	int error = fstat(fd, st);
+	if (error) err(EX_IOERR, "%s", path);
+	if (S_ISREG(st->st_mode) && st->st_size) {
+		tagsLen = st->st_size;
+		tagsBuf = mmap(NULL, tagsLen, PROT_READ, MAP_SHARED, fd, 0);
+		if (tagsBuf == MAP_FAILED) err(EX_IOERR, "%s", path);
+		close(fd);
+		return;
+	}
+	size_t cap = 64 * 1024;
+	char *buf = malloc(cap);
 	if (!buf) err(EX_OSERR, "malloc");
-	char *ptr = buf;
-	for (const char *ch = pattern; *ch; ++ch) {
-		if (strchr(".[*", *ch)) *ptr++ = '\\';
-		*ptr++ = *ch;
+	for (ssize_t n; 0 < (n = read(fd, &buf[tagsLen], cap - tagsLen));) {
+		tagsLen += n;
+		if (tagsLen < cap) continue;
+		buf = realloc(buf, (cap *= 2));
+		if (!buf) err(EX_OSERR, "realloc");
 	}
-	*ptr = '\0';
-	return buf;
+	close(fd);
+	tagsBuf = buf;
+}
+
+// The entries for each file are found through an index stored next to the
+// tags file, which holds the offsets of each file's lines sorted by name.
+// It is rebuilt whenever the size or modification time of the tags file
+// differs from when it was written.
+static const char Magic[8] = "htagml1";
+
+static struct Header {
+	char magic[8];
+	uint64_t size;
+	int64_t sec, nsec;
+	uint64_t groups;
+	uint64_t records;
+} *header;
+
+static struct Group {
+	uint64_t name;
+	uint64_t nameLen;
+	uint64_t first;
+	uint64_t count;
+} *groups;
+
+static uint64_t *offsets;
+
+static void setIndex(void *ptr) {
+	header = ptr;
+	groups = (struct Group *)&header[1];
+	offsets = (uint64_t *)&groups[header->groups];
+}
+
+// Whether every offset in the index lies within the tags file.
+static bool checkIndex(void) {
+	for (uint64_t i = 0; i < header->groups; ++i) {
+		const struct Group *group = &groups[i];
+		if (group->name > tagsLen) return false;
+		if (group->nameLen > tagsLen - group->name) return false;
+		if (group->first > header->records) return false;
+		if (group->count > header->records - group->first) return false;
+	}
+	for (uint64_t i = 0; i < header->records; ++i) {
+		if (offsets[i] >= tagsLen) return false;
+	}
+	return true;
+}
+
+static bool loadIndex(const char *path, const struct stat *st) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat index;
+	int error = fstat(fd, &index);
+	if (error || (size_t)index.st_size < sizeof(*header)) {
+		close(fd);
+		return false;
+	}
+	void *ptr = mmap(NULL, index.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) return false;
+
+	const struct Header *h = ptr;
+	if (
+		memcmp(h->magic, Magic, sizeof(Magic)) ||
+		h->size != (uint64_t)st->st_size ||
+		h->sec != st->st_mtim.tv_sec ||
+		h->nsec != st->st_mtim.tv_nsec ||
+		h->groups > index.st_size / sizeof(struct Group) ||
+		h->records > index.st_size / sizeof(*offsets) ||
+		sizeof(*h) + h->groups * sizeof(struct Group)
+		+ h->records * sizeof(*offsets) != (uint64_t)index.st_size
+	) {
+		munmap(ptr, index.st_size);
+		return false;
+	}
+	setIndex(ptr);
+	if (!checkIndex()) {
+		munmap(ptr, index.st_size);
+		return false;
+	}
+	return true;
+}
+
+static int compareName(
+	uint64_t name, uint64_t nameLen, const char *key, size_t keyLen
+) {
+	int cmp = memcmp(
+		&tagsBuf[name], key, (nameLen < keyLen ? nameLen : keyLen)
+	);
+	if (cmp) return cmp;
+	return (nameLen > keyLen) - (nameLen < keyLen);
+}
+
+struct Record {
+	uint64_t name;
+	uint64_t nameLen;
+	uint64_t offset;
+};
+
+static int compareRecord(const void *_a, const void *_b) {
+	const struct Record *a = _a, *b = _b;
+	int cmp = compareName(a->name, a->nameLen, &tagsBuf[b->name], b->nameLen);
+	if (cmp) return cmp;
+	return (a->offset > b->offset) - (a->offset < b->offset);
+}
+
+static void buildIndex(const char *path, const struct stat *st) {
+	size_t len = 0, cap = 1024;
+	struct Record *records = malloc(cap * sizeof(*records));
+	if (!records) err(EX_OSERR, "malloc");
+	for (size_t pos = 0; pos < tagsLen;) {
+		const char *line = &tagsBuf[pos];
+		const char *end = memchr(line, '\n', tagsLen - pos);
+		size_t lineLen = (end ? (size_t)(end - line) : tagsLen - pos);
+		const char *file = memchr(line, '\t', lineLen);
+		if (file) file++;
+		const char *def = (
+			file ? memchr(file, '\t', lineLen - (file - line)) : NULL
+		);
+		if (!def) errx(EX_DATAERR, "malformed tags file");
+		if (len == cap) {
+			records = realloc(records, (cap *= 2) * sizeof(*records));
+			if (!records) err(EX_OSERR, "realloc");
+		}
+		records[len++] = (struct Record) {
+			.name = file - tagsBuf,
+			.nameLen = def - file,
+			.offset = pos,
+		};
+		pos += lineLen + 1;
+	}
+	qsort(records, len, sizeof(*records), compareRecord);
+
+	size_t count = 0;
+	for (size_t i = 0; i < len; ++i) {
+		if (
+			!i ||
+			compareName(records[i-1].name, records[i-1].nameLen,
+				&tagsBuf[records[i].name], records[i].nameLen)
+		) count++;
+	}
+	size_t size = sizeof(*header) + count * sizeof(*groups)
+		+ len * sizeof(*offsets);
+	struct Header *ptr = calloc(1, size);
+	if (!ptr) err(EX_OSERR, "calloc");
+	*ptr = (struct Header) {
+		.size = st->st_size,
+		.sec = st->st_mtim.tv_sec,
+		.nsec = st->st_mtim.tv_nsec,
+		.groups = count,
+		.records = len,
+	};
+	memcpy(ptr->magic, Magic, sizeof(Magic));
+	setIndex(ptr);
+
+	struct Group *group = NULL;
+	for (size_t i = 0; i < len; ++i) {
+		if (
+			!group ||
+			compareName(group->name, group->nameLen,
+				&tagsBuf[records[i].name], records[i].nameLen)
+		) {
+			group = (group ? group + 1 : groups);
+			*group = (struct Group) {
+				.name = records[i].name,
+				.nameLen = records[i].nameLen,
+				.first = i,
+			};
+		}
+		group->count++;
+		offsets[i] = records[i].offset;
+	}
+	free(records);
+	if (!path) return;
+
+	// The index is only a cache, so failing to write it is not an error.
+	char temp[4096];
+	snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+	int fd = mkstemp(temp);
+	if (fd < 0) return;
+	fchmod(fd, 0644);
+	ssize_t n = write(fd, ptr, size);
+	int error = close(fd);
+	if (n != (ssize_t)size || error || rename(temp, path)) unlink(temp);
+}
+
+static const struct Group *findGroup(const char *name) {
+	size_t nameLen = strlen(name);
+	size_t lo = 0, hi = header->groups;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = compareName(
+			groups[mid].name, groups[mid].nameLen, name, nameLen
+		);
+		if (!cmp) return &groups[mid];
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
 }
 
 static size_t escape(bool esc, const char *ptr, size_t len) {
@@ -90,82 +315,54 @@ int main(int argc, char *argv[]) {
 	if (optind == argc) errx(EX_USAGE, "name required");
 	const char *name = argv[optind];
 
-	FILE *file = fopen(tagsFile, "r");
-	if (!file) err(EX_NOINPUT, "%s", tagsFile);
-
-	size_t len = 0;
-	size_t cap = 256;
-	struct Tag {
-		char *tag;
-		int num;
-		regex_t regex;
-	} *tags = malloc(cap * sizeof(*tags));
-	if (!tags) err(EX_OSERR, "malloc");
+	struct stat st;
+	readTags(tagsFile, &st);
+	char indexFile[4096];
+	snprintf(indexFile, sizeof(indexFile), "%s.index", tagsFile);
+	if (!S_ISREG(st.st_mode)) {
+		buildIndex(NULL, &st);
+	} else if (!loadIndex(indexFile, &st)) {
+		buildIndex(indexFile, &st);
+	}
+	const struct Group *group = findGroup(name);
 
 	char *buf = NULL;
 	size_t bufCap = 0;
-	while (0 < getline(&buf, &bufCap, file)) {
+	for (uint64_t i = 0; group && i < group->count; ++i) {
+		uint64_t offset = offsets[group->first + i];
+		const char *ptr = &tagsBuf[offset];
+		const char *end = memchr(ptr, '\n', tagsLen - offset);
+		size_t n = (end ? (size_t)(end - ptr) : tagsLen - offset);
+		if (bufCap < n + 2) {
+			buf = realloc(buf, (bufCap = n + 2));
+			if (!buf) err(EX_OSERR, "realloc");
+		}
+		memcpy(buf, ptr, n);
+		buf[n] = '\n';
+		buf[n+1] = '\0';
+
 		char *line = buf;
 		char *tag = strsep(&line, "\t");
 		char *file = strsep(&line, "\t");
 		char *def = strsep(&line, "\n");
 		if (!tag || !file || !def) errx(EX_DATAERR, "malformed tags file");
-
-		if (strcmp(file, name)) continue;
-		if (len == cap) {
-			tags = realloc(tags, (cap *= 2) * sizeof(*tags));
-			if (!tags) err(EX_OSERR, "realloc");
-		}
-		tags[len].tag = strdup(tag);
-		if (!tags[len].tag) err(EX_OSERR, "strdup");
-
-		tags[len].num = 0;
-		if (def[0] == '/' || def[0] == '?') {
-			def++;
-			def[strlen(def)-1] = '\0';
-			char *search = nomagic(def);
-			int error = regcomp(
-				&tags[len].regex, search, REG_NEWLINE | REG_NOSUB
-			);
-			free(search);
-			if (error) {
-				warnx("invalid regex for tag %s: %s", tag, def);
-				continue;
-			}
-		} else {
-			tags[len].num = strtol(def, &def, 10);
-			if (*def) {
-				warnx("invalid line number for tag %s: %s", tag, def);
-				continue;
-			}
-		}
-		len++;
+		tagsAdd(tag, def);
 	}
-	fclose(file);
+	tagsIndex();
 
-	file = fopen(name, "r");
+	FILE *file = fopen(name, "r");
 	if (!file) err(EX_NOINPUT, "%s", name);
 
 	int num = 0;
 	printf(pre ? "<pre>" : index ? "<ul class=\"index\">\n" : "");
-	while (0 < getline(&buf, &bufCap, file) && ++num) {
-		struct Tag *tag = NULL;
-		for (size_t i = 0; i < len; ++i) {
-			if (tags[i].num) {
-				if (num != tags[i].num) continue;
-			} else {
-				if (regexec(&tags[i].regex, buf, 0, NULL, 0)) continue;
-			}
-			tag = &tags[i];
-			tag->num = num;
-			break;
-		}
+	for (ssize_t n; 0 < (n = getline(&buf, &bufCap, file)) && ++num;) {
+		const char *tag = tagsMatch(num, buf, n);
 		if (index) {
 			if (!tag) continue;
 			printf("<li><a class=\"tag\" href=\"#");
-			id(tag->tag);
+			id(tag);
 			printf("\">");
-			escape(true, tag->tag, strlen(tag->tag));
+			escape(true, tag, strlen(tag));
 			printf("</a></li>\n");
 			continue;
 		}
@@ -180,12 +377,12 @@ int main(int argc, char *argv[]) {
 			continue;
 		}
 
-		size_t mlen = strlen(tag->tag);
-		char *match = (pipe ? hstrstr : strstr)(buf, tag->tag);
+		size_t mlen = strlen(tag);
+		char *match = (pipe ? hstrstr : strstr)(buf, tag);
 		while (match > buf && isalnum(match[-1])) {
-			match = (pipe ? hstrstr : strstr)(&match[mlen], tag->tag);
+			match = (pipe ? hstrstr : strstr)(&match[mlen], tag);
 		}
-		if (!match && tag->tag[0] == 'M') {
+		if (!match && tag[0] == 'M') {
 			mlen = 4;
 			match = (pipe ? hstrstr : strstr)(buf, "main");
 		}
@@ -195,9 +392,9 @@ int main(int argc, char *argv[]) {
 		}
 		escape(!pipe, buf, match - buf);
 		printf("<a class=\"tag\" id=\"");
-		id(tag->tag);
+		id(tag);
 		printf("\" href=\"#");
-		id(tag->tag);
+		id(tag);
 		printf("\">");
 		match += escape(!pipe, match, mlen);
 		printf("</a>");
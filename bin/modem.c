@@ -15,12 +15,17 @@
  */
 
 #include <err.h>
+#include <errno.h>
 #include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <sysexits.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #if defined __FreeBSD__
@@ -39,10 +44,71 @@ static void restoreTerm(void) {
 	tcsetattr(STDIN_FILENO, TCSADRAIN, &saveTerm);
 }
 
+static uint baudRate = 19200;
+
+static uint64_t now(void) {
+	struct timespec ts;
+	int error = clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (error) err(EX_OSERR, "clock_gettime");
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Bytes are due on a schedule from the time a line last became busy, so
+// oversleeping only delays a batch and does not lower the overall rate.
+struct Line {
+	int in, out;
+	bool eof;
+	uint64_t epoch;
+	uint64_t sent;
+	size_t len;
+	byte buf[4096];
+};
+
+static uint64_t lineDue(const struct Line *line, uint64_t time) {
+	return (time - line->epoch) * baudRate / 8 / 1000000;
+}
+
+static void lineRead(struct Line *line, uint64_t time) {
+	ssize_t size = read(
+		line->in, &line->buf[line->len], sizeof(line->buf) - line->len
+	);
+	if (size < 0 && errno == EIO) size = 0;
+	if (size < 0) err(EX_IOERR, "read(%d)", line->in);
+	if (!size) {
+		line->eof = true;
+		return;
+	}
+	// Idle time does not accumulate credit for a burst.
+	if (!line->len && lineDue(line, time) > line->sent) {
+		line->epoch = time;
+		line->sent = 0;
+	}
+	line->len += size;
+}
+
+static void lineWrite(struct Line *line, uint64_t time) {
+	uint64_t due = lineDue(line, time);
+	if (!line->len || due <= line->sent) return;
+	due -= line->sent;
+	size_t len = (due < line->len ? due : line->len);
+	ssize_t size = write(line->out, line->buf, len);
+	if (size < 0) err(EX_IOERR, "write(%d)", line->out);
+	line->len -= size;
+	line->sent += size;
+	memmove(line->buf, &line->buf[size], line->len);
+}
+
+// Milliseconds until the next byte is due, rounded up.
+static int lineWait(const struct Line *line, uint64_t time) {
+	if (!line->len) return -1;
+	uint64_t next = line->epoch
+		+ ((line->sent + 1) * 8 * 1000000 + baudRate - 1) / baudRate;
+	return (next > time ? (next - time + 999) / 1000 : 0);
+}
+
 int main(int argc, char *argv[]) {
 	int error;
 
-	uint baudRate = 19200;
 	for (int opt; 0 < (opt = getopt(argc, argv, "r:"));) {
 		switch (opt) {
 			break; case 'r': baudRate = strtoul(optarg, NULL, 10);
@@ -73,25 +139,32 @@ int main(int argc, char *argv[]) {
 		err(EX_NOINPUT, "%s", argv[optind]);
 	}
 
-	byte c;
-	struct pollfd fds[2] = {
-		{ .events = POLLIN, .fd = STDIN_FILENO },
-		{ .events = POLLIN, .fd = pty },
+	uint64_t time = now();
+	struct Line lines[2] = {
+		{ .in = STDIN_FILENO, .out = pty, .epoch = time },
+		{ .in = pty, .out = STDOUT_FILENO, .epoch = time },
 	};
-	while (usleep(8 * 1000000 / baudRate), 0 < poll(fds, 2, -1)) {
-		if (fds[0].revents) {
-			ssize_t size = read(STDIN_FILENO, &c, 1);
-			if (size < 0) err(EX_IOERR, "read(%d)", STDIN_FILENO);
-			size = write(pty, &c, 1);
-			if (size < 0) err(EX_IOERR, "write(%d)", pty);
+	struct pollfd fds[2];
+	while (!lines[1].eof || lines[1].len) {
+		int timeout = -1;
+		for (int i = 0; i < 2; ++i) {
+			struct Line *line = &lines[i];
+			bool room = !line->eof && line->len < sizeof(line->buf);
+			fds[i] = (struct pollfd) {
+				.fd = (room ? line->in : -1),
+				.events = POLLIN,
+			};
+			int wait = lineWait(line, time);
+			if (wait >= 0 && (timeout < 0 || wait < timeout)) timeout = wait;
 		}
 
-		if (fds[1].revents) {
-			ssize_t size = read(pty, &c, 1);
-			if (size < 0) err(EX_IOERR, "read(%d)", pty);
-			if (!size) break;
-			size = write(STDOUT_FILENO, &c, 1);
-			if (size < 0) err(EX_IOERR, "write(%d)", STDOUT_FILENO);
+		int nfds = poll(fds, 2, timeout);
+		if (nfds < 0 && errno != EINTR) err(EX_IOERR, "poll");
+		time = now();
+
+		for (int i = 0; i < 2; ++i) {
+			if (nfds > 0 && fds[i].revents) lineRead(&lines[i], time);
+			lineWrite(&lines[i], time);
 		}
 	}
 
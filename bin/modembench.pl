@@ -0,0 +1,55 @@
+#!/usr/bin/env perl
+use strict;
+use warnings;
+use Time::HiRes qw(time);
+
+# Compare the rate modem outputs at with the rate asked of it:
+# modembench.pl [-s secs] [-t percent] modem [rate ...]
+# Standard input must be a terminal, which modem makes raw while it runs.
+my %opts;
+while (@ARGV && $ARGV[0] =~ /^-([st])$/) {
+	shift;
+	$opts{$1} = shift;
+}
+my ($modem, @rates) = @ARGV;
+die "usage: $0 [-s secs] [-t percent] modem [rate ...]\n" unless $modem;
+die "standard input is not a terminal\n" unless -t STDIN;
+@rates = qw(300 1200 2400 9600 19200 38400 57600 115200) unless @rates;
+my $secs = $opts{s} // 2;
+my $threshold = ($opts{t} // 1) / 100;
+
+# Returns bits per second from the first byte of output to the last.
+sub run {
+	my ($rate) = @_;
+	my $bytes = int($rate * $secs / 8);
+	my $command = qq{head -c $bytes /dev/zero | tr '\\0' x};
+	open my $out, '-|', $modem, '-r', $rate, '--', 'sh', '-c', $command
+		or die "$modem: $!\n";
+	my ($first, $last, $len);
+	while (my $n = sysread $out, my $buf, 65536) {
+		$last = time;
+		if (defined $first) {
+			$len += $n;
+		} else {
+			$first = $last;
+			$len = 0;
+		}
+	}
+	close $out or die "$modem -r $rate failed\n";
+	die "$modem -r $rate output too little\n" unless $len && $last > $first;
+	return $len * 8 / ($last - $first);
+}
+
+my $off = 0;
+printf "%-8s %10s %8s\n", qw(rate measured error);
+for my $rate (@rates) {
+	my $measured = run($rate);
+	my $error = ($measured - $rate) / $rate;
+	printf "%-8d %10.1f %+7.2f%%", $rate, $measured, 100 * $error;
+	if (abs $error > $threshold) {
+		print ' OFF';
+		$off++;
+	}
+	print "\n";
+}
+exit ($off ? 1 : 0);
@@ -14,16 +14,27 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <assert.h>
 #include <err.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <regex.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "tags.h"
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
 static void escape(FILE *file, const char *str, size_t len) {
 	for (size_t i = 0; i < len; ++i) {
 		if (str[i] == '\\' || str[i] == '/') {
@@ -33,67 +44,463 @@ static void escape(FILE *file, const char *str, size_t len) {
 	}
 }
 
+static struct File {
+	const char *path;
+	const regex_t *regex;
+	struct stat st;
+	bool scan;
+	bool known;
+	bool changed;
+	uint64_t hash;
+	char *tags;
+	size_t len;
+} *files;
+static size_t filesLen;
+
+static uint64_t hash(uint64_t h, const char *ptr, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		h = (h ^ (unsigned char)ptr[i]) * 0x100000001B3;
+	}
+	return h;
+}
+
+// Write the tags of a file to out, preceded by its index, content hash and
+// the length of its tags.
+static void scan(FILE *out, size_t i) {
+	static char *buf;
+	static size_t cap;
+	struct File *file = &files[i];
+	FILE *in = fopen(file->path, "r");
+	if (!in) err(EX_NOINPUT, "%s", file->path);
+
+	char *tags;
+	size_t len;
+	FILE *mem = open_memstream(&tags, &len);
+	if (!mem) err(EX_OSERR, "open_memstream");
+	uint64_t h = 0xCBF29CE484222325;
+	for (ssize_t n; 0 < (n = getline(&buf, &cap, in));) {
+		h = hash(h, buf, n);
+		regmatch_t match[2];
+		if (regexec(file->regex, buf, 2, match, 0)) continue;
+		fprintf(
+			mem, "%.*s\t%s\t/^",
+			(int)(match[1].rm_eo - match[1].rm_so), &buf[match[1].rm_so],
+			file->path
+		);
+		escape(mem, buf, match[0].rm_eo);
+		fprintf(mem, "/\n");
+	}
+	if (ferror(in)) err(EX_IOERR, "%s", file->path);
+	fclose(in);
+	fclose(mem);
+
+	fprintf(out, "%zu %" PRIx64 " %zu\n", i, h, len);
+	fwrite(tags, len, 1, out);
+	free(tags);
+}
+
+static void collect(FILE *out) {
+	rewind(out);
+	size_t i, len;
+	uint64_t h;
+	while (3 == fscanf(out, "%zu %" SCNx64 " %zu", &i, &h, &len)) {
+		if (getc(out) != '\n') errx(EX_SOFTWARE, "bad scan output");
+		if (i >= filesLen) errx(EX_SOFTWARE, "bad scan index %zu", i);
+		struct File *file = &files[i];
+		file->changed = !file->known || h != file->hash;
+		file->hash = h;
+		file->len = len;
+		file->tags = malloc(len + 1);
+		if (!file->tags) err(EX_OSERR, "malloc");
+		if (len && 1 != fread(file->tags, len, 1, out)) {
+			err(EX_IOERR, "fread");
+		}
+		file->tags[len] = '\0';
+	}
+	if (ferror(out)) err(EX_IOERR, "fscanf");
+	fclose(out);
+}
+
+// Files to scan are divided between jobs processes, each writing its results
+// to a temporary file.
+static void scanFiles(size_t jobs) {
+	size_t count = 0;
+	for (size_t i = 0; i < filesLen; ++i) {
+		if (files[i].scan) count++;
+	}
+	if (jobs > count) jobs = count;
+	if (jobs < 2) {
+		FILE *out = tmpfile();
+		if (!out) err(EX_CANTCREAT, "tmpfile");
+		for (size_t i = 0; i < filesLen; ++i) {
+			if (files[i].scan) scan(out, i);
+		}
+		collect(out);
+		return;
+	}
+
+	FILE **outs = calloc(jobs, sizeof(*outs));
+	pid_t *pids = calloc(jobs, sizeof(*pids));
+	if (!outs || !pids) err(EX_OSERR, "calloc");
+	for (size_t j = 0; j < jobs; ++j) {
+		outs[j] = tmpfile();
+		if (!outs[j]) err(EX_CANTCREAT, "tmpfile");
+		pids[j] = fork();
+		if (pids[j] < 0) err(EX_OSERR, "fork");
+		if (pids[j]) continue;
+		for (size_t i = 0, n = 0; i < filesLen; ++i) {
+			if (!files[i].scan) continue;
+			if (n++ % jobs == j) scan(outs[j], i);
+		}
+		if (fflush(outs[j])) err(EX_IOERR, "tmpfile");
+		_exit(EX_OK);
+	}
+	for (size_t j = 0; j < jobs; ++j) {
+		int status;
+		pid_t pid = waitpid(pids[j], &status, 0);
+		if (pid < 0) err(EX_OSERR, "waitpid");
+		if (WIFSIGNALED(status)) {
+			errx(EX_SOFTWARE, "job %zu: signal %d", j, WTERMSIG(status));
+		}
+		if (WEXITSTATUS(status)) exit(WEXITSTATUS(status));
+		collect(outs[j]);
+	}
+	free(outs);
+	free(pids);
+}
+
+// The modification time, size and content hash of each file tagged in update
+// mode are kept in tagsfile.meta, along with the size and modification time
+// of the tags file they describe.
+static struct Meta {
+	char *path;
+	struct timespec mtime;
+	off_t size;
+	uint64_t hash;
+	bool keep;
+} *metas;
+static size_t metasLen;
+
+static int compareMeta(const void *_a, const void *_b) {
+	const struct Meta *a = _a, *b = _b;
+	return strcmp(a->path, b->path);
+}
+
+static bool sameTime(struct timespec a, struct timespec b) {
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static void readMeta(const char *path, const struct stat *tags) {
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		if (errno != ENOENT) warn("%s", path);
+		return;
+	}
+	intmax_t size, sec;
+	long nsec;
+	int n = fscanf(file, "%jd %jd %ld\n", &size, &sec, &nsec);
+	if (
+		n != 3 || size != tags->st_size ||
+		!sameTime((struct timespec) { sec, nsec }, tags->st_mtim)
+	) {
+		fclose(file);
+		return;
+	}
+
+	size_t cap = 0;
+	char *buf = NULL;
+	size_t metasCap = 0;
+	for (ssize_t len; 0 < (len = getline(&buf, &cap, file));) {
+		if (buf[len-1] == '\n') buf[len-1] = '\0';
+		uint64_t h;
+		char *tab = strchr(buf, '\t');
+		n = sscanf(buf, "%jd %ld %jd %" SCNx64, &sec, &nsec, &size, &h);
+		if (n != 4 || !tab) errx(EX_DATAERR, "%s: malformed line", path);
+		if (metasLen == metasCap) {
+			metasCap = (metasCap ? metasCap * 2 : 256);
+			metas = realloc(metas, metasCap * sizeof(*metas));
+			if (!metas) err(EX_OSERR, "realloc");
+		}
+		metas[metasLen] = (struct Meta) {
+			.path = strdup(&tab[1]),
+			.mtime = { sec, nsec },
+			.size = size,
+			.hash = h,
+		};
+		if (!metas[metasLen].path) err(EX_OSERR, "strdup");
+		metasLen++;
+	}
+	if (ferror(file)) err(EX_IOERR, "%s", path);
+	fclose(file);
+	free(buf);
+	qsort(metas, metasLen, sizeof(*metas), compareMeta);
+}
+
+static struct Meta *findMeta(const char *path) {
+	if (!metasLen) return NULL;
+	return bsearch(
+		&(struct Meta) { .path = (char *)path },
+		metas, metasLen, sizeof(*metas), compareMeta
+	);
+}
+
+static char **drops;
+static size_t dropsLen;
+
+static int compareStr(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static bool dropped(const char *path) {
+	return dropsLen && bsearch(
+		&path, drops, dropsLen, sizeof(*drops), compareStr
+	);
+}
+
+struct Lines {
+	char **ptr;
+	size_t len, cap;
+};
+
+static void push(struct Lines *lines, char *line) {
+	if (lines->len == lines->cap) {
+		lines->cap = (lines->cap ? lines->cap * 2 : 1024);
+		lines->ptr = realloc(lines->ptr, lines->cap * sizeof(*lines->ptr));
+		if (!lines->ptr) err(EX_OSERR, "realloc");
+	}
+	lines->ptr[lines->len++] = line;
+}
+
+// Split buf into lines in place, pushing those not dropped, and return whether
+// they were in sorted order.
+static bool split(struct Lines *lines, char *buf, bool drop) {
+	bool sorted = true;
+	for (char *line; NULL != (line = strsep(&buf, "\n"));) {
+		if (!*line) continue;
+		if (drop) {
+			char *file = strchr(line, '\t');
+			char *def = (file ? strchr(&file[1], '\t') : NULL);
+			if (!def) errx(EX_DATAERR, "malformed tags file");
+			*def = '\0';
+			bool skip = dropped(&file[1]);
+			*def = '\t';
+			if (skip) continue;
+		}
+		if (lines->len && strcmp(lines->ptr[lines->len-1], line) > 0) {
+			sorted = false;
+		}
+		push(lines, line);
+	}
+	return sorted;
+}
+
+static char *readFile(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		if (errno != ENOENT) err(EX_NOINPUT, "%s", path);
+		return NULL;
+	}
+	char *buf;
+	size_t len;
+	FILE *mem = open_memstream(&buf, &len);
+	if (!mem) err(EX_OSERR, "open_memstream");
+	char chunk[64 * 1024];
+	for (size_t n; 0 < (n = fread(chunk, 1, sizeof(chunk), file));) {
+		fwrite(chunk, n, 1, mem);
+	}
+	if (ferror(file)) err(EX_IOERR, "%s", path);
+	fclose(file);
+	fclose(mem);
+	return buf;
+}
+
+static FILE *createTemp(const char *path, char *temp, size_t size) {
+	snprintf(temp, size, "%s.XXXXXX", path);
+	int fd = mkstemp(temp);
+	if (fd < 0) err(EX_CANTCREAT, "%s", temp);
+	fchmod(fd, 0644);
+	FILE *file = fdopen(fd, "w");
+	if (!file) err(EX_OSERR, "fdopen");
+	return file;
+}
+
+static void commitTemp(FILE *file, const char *temp, const char *path) {
+	int error = fclose(file);
+	if (!error) error = rename(temp, path);
+	if (error) {
+		warn("%s", temp);
+		unlink(temp);
+		exit(EX_IOERR);
+	}
+}
+
+static void update(const char *path, size_t jobs) {
+	char metaPath[4096];
+	snprintf(metaPath, sizeof(metaPath), "%s.meta", path);
+	struct stat tags;
+	int error = stat(path, &tags);
+	if (error && errno != ENOENT) err(EX_NOINPUT, "%s", path);
+	if (!error) readMeta(metaPath, &tags);
+
+	bool dirty = (error != 0);
+	for (size_t i = 0; i < filesLen; ++i) {
+		struct File *file = &files[i];
+		struct Meta *meta = findMeta(file->path);
+		if (meta) {
+			meta->keep = true;
+			file->known = true;
+			file->hash = meta->hash;
+		}
+		file->scan = !meta || meta->size != file->st.st_size ||
+			!sameTime(meta->mtime, file->st.st_mtim);
+		if (file->scan) dirty = true;
+	}
+	for (size_t i = 0; i < metasLen; ++i) {
+		if (metas[i].keep) continue;
+		struct stat st;
+		if (!stat(metas[i].path, &st) || errno != ENOENT) {
+			metas[i].keep = true;
+			continue;
+		}
+		drops = realloc(drops, (dropsLen + 1) * sizeof(*drops));
+		if (!drops) err(EX_OSERR, "realloc");
+		drops[dropsLen++] = metas[i].path;
+		dirty = true;
+	}
+	if (!dirty) return;
+	scanFiles(jobs);
+
+	struct Lines lines = {0};
+	for (size_t i = 0; i < filesLen; ++i) {
+		if (!files[i].changed) continue;
+		drops = realloc(drops, (dropsLen + 1) * sizeof(*drops));
+		if (!drops) err(EX_OSERR, "realloc");
+		drops[dropsLen++] = (char *)files[i].path;
+		split(&lines, files[i].tags, false);
+	}
+	qsort(drops, dropsLen, sizeof(*drops), compareStr);
+	qsort(lines.ptr, lines.len, sizeof(*lines.ptr), compareStr);
+
+	char temp[4096];
+	if (dropsLen || error) {
+		struct Lines old = {0};
+		char *buf = readFile(path);
+		if (buf && !split(&old, buf, true)) {
+			qsort(old.ptr, old.len, sizeof(*old.ptr), compareStr);
+		}
+		FILE *file = createTemp(path, temp, sizeof(temp));
+		for (size_t i = 0, j = 0; i < old.len || j < lines.len;) {
+			if (
+				j == lines.len ||
+				(i < old.len && strcmp(old.ptr[i], lines.ptr[j]) <= 0)
+			) {
+				fprintf(file, "%s\n", old.ptr[i++]);
+			} else {
+				fprintf(file, "%s\n", lines.ptr[j++]);
+			}
+		}
+		if (fflush(file)) err(EX_IOERR, "%s", temp);
+		error = fstat(fileno(file), &tags);
+		if (error) err(EX_IOERR, "%s", temp);
+		commitTemp(file, temp, path);
+		free(buf);
+		free(old.ptr);
+	}
+	free(lines.ptr);
+
+	FILE *file = createTemp(metaPath, temp, sizeof(temp));
+	fprintf(
+		file, "%jd %jd %ld\n", (intmax_t)tags.st_size,
+		(intmax_t)tags.st_mtim.tv_sec, (long)tags.st_mtim.tv_nsec
+	);
+	for (size_t i = 0; i < filesLen; ++i) {
+		struct Meta *meta = findMeta(files[i].path);
+		if (meta) meta->keep = false;
+	}
+	size_t i = 0, j = 0;
+	while (i < metasLen || j < filesLen) {
+		if (i < metasLen && !metas[i].keep) {
+			i++;
+			continue;
+		}
+		if (
+			j == filesLen ||
+			(i < metasLen && strcmp(metas[i].path, files[j].path) < 0)
+		) {
+			fprintf(
+				file, "%jd %ld %jd %" PRIx64 "\t%s\n",
+				(intmax_t)metas[i].mtime.tv_sec, (long)metas[i].mtime.tv_nsec,
+				(intmax_t)metas[i].size, metas[i].hash, metas[i].path
+			);
+			i++;
+		} else {
+			const struct File *f = &files[j++];
+			fprintf(
+				file, "%jd %ld %jd %" PRIx64 "\t%s\n",
+				(intmax_t)f->st.st_mtim.tv_sec, (long)f->st.st_mtim.tv_nsec,
+				(intmax_t)f->st.st_size, f->hash, f->path
+			);
+		}
+	}
+	commitTemp(file, temp, metaPath);
+}
+
+static int compareFile(const void *_a, const void *_b) {
+	const struct File *a = _a, *b = _b;
+	return strcmp(a->path, b->path);
+}
+
 int main(int argc, char *argv[]) {
 	bool append = false;
+	bool incremental = false;
+	size_t jobs = 1;
 	const char *path = "tags";
-	for (int opt; 0 < (opt = getopt(argc, argv, "af:"));) {
+	for (int opt; 0 < (opt = getopt(argc, argv, "af:j:u"));) {
 		switch (opt) {
 			break; case 'a': append = true;
 			break; case 'f': path = optarg;
+			break; case 'j': jobs = strtoul(optarg, NULL, 10);
+			break; case 'u': incremental = true;
 			break; default:  return EX_USAGE;
 		}
 	}
+	if (!jobs || (append && incremental)) return EX_USAGE;
 
-	FILE *tags = fopen(path, (append ? "a" : "w"));
-	if (!tags) err(EX_CANTCREAT, "%s", path);
-
-	regex_t makeFile, makeLine;
-	regex_t mdocFile, mdocLine;
-	regex_t shFile, shLine;
-	int error = 0
-		|| regcomp(&makeFile, "(^|/)Makefile|[.]mk$", REG_EXTENDED | REG_NOSUB)
-		|| regcomp(
-			&makeLine,
-			"^([.][^:$A-Z][^:$[:space:]]*|[^.:$][^:$[:space:]]*):",
-			REG_EXTENDED
-		)
-		|| regcomp(&mdocFile, "[.][1-9]$", REG_EXTENDED | REG_NOSUB)
-		|| regcomp(&mdocLine, "^[.]S[hs] ([^\t\n]+)", REG_EXTENDED)
-		|| regcomp(
-			&shFile, "(^|/)[.](profile|shrc)|[.]sh$", REG_EXTENDED | REG_NOSUB
-		)
-		|| regcomp(&shLine, "^([_[:alnum:]]+)[[:blank:]]*[(][)]", REG_EXTENDED);
-	assert(!error);
-
-	size_t cap = 0;
-	char *buf = NULL;
+	files = calloc(argc - optind + 1, sizeof(*files));
+	if (!files) err(EX_OSERR, "calloc");
 	for (int i = optind; i < argc; ++i) {
-		const regex_t *regex;
-		if (!regexec(&makeFile, argv[i], 0, NULL, 0)) {
-			regex = &makeLine;
-		} else if (!regexec(&mdocFile, argv[i], 0, NULL, 0)) {
-			regex = &mdocLine;
-		} else if (!regexec(&shFile, argv[i], 0, NULL, 0)) {
-			regex = &shLine;
-		} else {
+		const regex_t *regex = tagsRule(argv[i]);
+		if (!regex) {
 			warnx("skipping unknown file type %s", argv[i]);
 			continue;
 		}
+		struct File *file = &files[filesLen++];
+		file->path = argv[i];
+		file->regex = regex;
+		file->scan = true;
+		if (!incremental) continue;
+		int error = stat(argv[i], &file->st);
+		if (error) err(EX_NOINPUT, "%s", argv[i]);
+	}
 
-		FILE *file = fopen(argv[i], "r");
-		if (!file) err(EX_NOINPUT, "%s", argv[i]);
-
-		while (0 < getline(&buf, &cap, file)) {
-			regmatch_t match[2];
-			if (regexec(regex, buf, 2, match, 0)) continue;
-			fprintf(
-				tags, "%.*s\t%s\t/^",
-				(int)(match[1].rm_eo - match[1].rm_so), &buf[match[1].rm_so],
-				argv[i]
-			);
-			escape(tags, buf, match[0].rm_eo);
-			fprintf(tags, "/\n");
+	if (incremental) {
+		qsort(files, filesLen, sizeof(*files), compareFile);
+		size_t len = 0;
+		for (size_t i = 0; i < filesLen; ++i) {
+			if (len && !strcmp(files[len-1].path, files[i].path)) continue;
+			files[len++] = files[i];
 		}
-		fclose(file);
+		filesLen = len;
+		update(path, jobs);
+		return EX_OK;
+	}
+
+	FILE *tags = fopen(path, (append ? "a" : "w"));
+	if (!tags) err(EX_CANTCREAT, "%s", path);
+	scanFiles(jobs);
+	for (size_t i = 0; i < filesLen; ++i) {
+		fwrite(files[i].tags, files[i].len, 1, tags);
 	}
+	int error = fclose(tags);
+	if (error) err(EX_IOERR, "%s", path);
 }
@@ -0,0 +1,199 @@
+/* Copyright (C) 2021  C. McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rec.h"
+
+typedef unsigned char byte;
+
+static const byte *base, *end;
+
+static struct Key {
+	uint64_t time;
+	uint64_t offset;
+} *keys;
+static size_t len, cap;
+
+static void keyPush(uint64_t time, uint64_t offset) {
+	if (len == cap) {
+		cap = (cap ? cap * 2 : 64);
+		keys = realloc(keys, cap * sizeof(*keys));
+		if (!keys) err(EX_OSERR, "realloc");
+	}
+	keys[len++] = (struct Key) { time, offset };
+}
+
+static int keysIndex(void) {
+	size_t size = end - base;
+	if (size < 2 * sizeof(RecMagic) + 8) return 0;
+	if (memcmp(end - sizeof(RecMagic), RecMagic, sizeof(RecMagic))) return 0;
+	const byte *footer = end - sizeof(RecMagic) - 8;
+	uint64_t offset = 0;
+	for (int i = 0; i < 8; ++i) {
+		offset |= (uint64_t)footer[i] << (8 * i);
+	}
+	if (offset < sizeof(RecMagic) || offset >= (uint64_t)(footer - base)) {
+		return 0;
+	}
+
+	const byte *ptr = &base[offset];
+	struct RecFrame frame = {0};
+	if (!recGetFrame(&ptr, footer, &frame)) return 0;
+	if (frame.type != RecIndex) return 0;
+
+	ptr = frame.ptr;
+	const byte *index = &frame.ptr[frame.len];
+	uint64_t count;
+	if (!recGetVarint(&ptr, index, &count)) return 0;
+	struct Key key = {0};
+	for (uint64_t i = 0; i < count; ++i) {
+		uint64_t time, offset;
+		if (!recGetVarint(&ptr, index, &time)) return 0;
+		if (!recGetVarint(&ptr, index, &offset)) return 0;
+		key.time += time;
+		key.offset += offset;
+		if (key.offset >= (uint64_t)(footer - base)) return 0;
+		keyPush(key.time, key.offset);
+	}
+	end = &base[offset];
+	return 1;
+}
+
+// Without an index, as when recording was interrupted, find the key frames by
+// reading every frame header.
+static void keysScan(void) {
+	const byte *ptr = &base[sizeof(RecMagic)];
+	struct RecFrame frame = {0};
+	for (;;) {
+		const byte *prev = ptr;
+		if (!recGetFrame(&ptr, end, &frame)) {
+			end = prev;
+			break;
+		}
+		if (frame.type == RecIndex) {
+			end = prev;
+			break;
+		}
+		if (frame.type == RecKey) keyPush(frame.time, prev - base);
+	}
+}
+
+static void output(const byte *ptr, size_t len) {
+	if (len && !fwrite(ptr, len, 1, stdout)) err(EX_IOERR, "(stdout)");
+}
+
+int main(int argc, char *argv[]) {
+	double speed = 1.0;
+	double start = 0.0;
+	for (int opt; 0 < (opt = getopt(argc, argv, "s:t:"));) {
+		switch (opt) {
+			break; case 's': speed = strtod(optarg, NULL);
+			break; case 't': start = strtod(optarg, NULL);
+			break; default:  return EX_USAGE;
+		}
+	}
+	if (optind == argc) errx(EX_USAGE, "no file");
+	if (speed <= 0.0) errx(EX_USAGE, "invalid speed");
+	if (start < 0.0) errx(EX_USAGE, "invalid start time");
+	const char *path = argv[optind];
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) err(EX_NOINPUT, "%s", path);
+	struct stat stat;
+	int error = fstat(fd, &stat);
+	if (error) err(EX_IOERR, "%s", path);
+	if ((size_t)stat.st_size < sizeof(RecMagic)) {
+		errx(EX_DATAERR, "%s: not a recording", path);
+	}
+	base = mmap(NULL, stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) err(EX_OSERR, "mmap");
+	end = &base[stat.st_size];
+	if (memcmp(base, RecMagic, sizeof(RecMagic))) {
+		errx(EX_DATAERR, "%s: not a recording", path);
+	}
+
+	if (!keysIndex()) keysScan();
+	if (!len) errx(EX_DATAERR, "%s: no key frames", path);
+
+	uint64_t from = start * 1000000;
+	size_t i = 0;
+	while (i + 1 < len && keys[i + 1].time <= from) i++;
+
+	const byte *ptr = &base[keys[i].offset];
+	struct RecFrame frame = {0};
+	if (!recGetFrame(&ptr, end, &frame)) {
+		errx(EX_DATAERR, "%s: truncated key frame", path);
+	}
+	// The frame delta is relative to a frame which is not read here.
+	frame.time = keys[i].time;
+	output(frame.ptr, frame.len);
+
+	struct timespec origin;
+	error = clock_gettime(CLOCK_MONOTONIC, &origin);
+	if (error) err(EX_OSERR, "clock_gettime");
+
+	while (recGetFrame(&ptr, end, &frame)) {
+		// Key frames only restate the screen for seeking.
+		if (frame.type != RecData) continue;
+		if (frame.time > from) {
+			error = fflush(stdout);
+			if (error) err(EX_IOERR, "(stdout)");
+			uint64_t delay = (frame.time - from) / speed;
+			struct timespec until = {
+				.tv_sec = origin.tv_sec + delay / 1000000,
+				.tv_nsec = origin.tv_nsec + delay % 1000000 * 1000,
+			};
+			if (until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			// Sleep relative to the deadline, since clock_nanosleep is not
+			// everywhere.
+			for (;;) {
+				struct timespec now;
+				error = clock_gettime(CLOCK_MONOTONIC, &now);
+				if (error) err(EX_OSERR, "clock_gettime");
+				struct timespec left = {
+					.tv_sec = until.tv_sec - now.tv_sec,
+					.tv_nsec = until.tv_nsec - now.tv_nsec,
+				};
+				if (left.tv_nsec < 0) {
+					left.tv_sec--;
+					left.tv_nsec += 1000000000;
+				}
+				if (left.tv_sec < 0) break;
+				if (!left.tv_sec && !left.tv_nsec) break;
+				error = nanosleep(&left, NULL);
+				if (error && errno != EINTR) err(EX_OSERR, "nanosleep");
+			}
+		}
+		output(frame.ptr, frame.len);
+	}
+	error = fflush(stdout);
+	if (error) err(EX_IOERR, "(stdout)");
+}
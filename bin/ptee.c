@@ -15,14 +15,20 @@
  */
 
 #include <err.h>
+#include <errno.h>
+#include <locale.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <sysexits.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #if defined __FreeBSD__
@@ -33,6 +39,9 @@
 #include <util.h>
 #endif
 
+#include "rec.h"
+#include "term.h"
+
 typedef unsigned char byte;
 
 static struct termios saveTerm;
@@ -40,7 +49,121 @@ static void restoreTerm(void) {
 	tcsetattr(STDIN_FILENO, TCSADRAIN, &saveTerm);
 }
 
+static uint64_t now(void) {
+	struct timespec ts;
+	int error = clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (error) err(EX_OSERR, "clock_gettime");
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct {
+	bool on;
+	uint64_t start;
+	uint64_t time;
+	uint64_t offset;
+	uint64_t keyTime;
+	uint64_t keyData;
+	struct Key {
+		uint64_t time;
+		uint64_t offset;
+	} *keys;
+	size_t len, cap;
+} rec;
+
+static void recPut(const void *ptr, size_t len) {
+	if (len && !fwrite(ptr, len, 1, stdout)) err(EX_IOERR, "(stdout)");
+	rec.offset += len;
+}
+
+static void recFrame(byte type, uint64_t time, const void *ptr, size_t len) {
+	byte head[21] = { type };
+	size_t n = 1;
+	n += recVarint(&head[n], time - rec.time);
+	n += recVarint(&head[n], len);
+	rec.time = time;
+	recPut(head, n);
+	recPut(ptr, len);
+}
+
+static void recKey(struct Term *term, uint64_t time) {
+	if (rec.len == rec.cap) {
+		rec.cap = (rec.cap ? rec.cap * 2 : 64);
+		rec.keys = realloc(rec.keys, rec.cap * sizeof(*rec.keys));
+		if (!rec.keys) err(EX_OSERR, "realloc");
+	}
+	rec.keys[rec.len++] = (struct Key) { time, rec.offset };
+
+	char *buf;
+	size_t len;
+	FILE *file = open_memstream(&buf, &len);
+	if (!file) err(EX_OSERR, "open_memstream");
+	termDraw(file, term);
+	int error = fclose(file);
+	if (error) err(EX_OSERR, "open_memstream");
+	recFrame(RecKey, time, buf, len);
+	free(buf);
+
+	rec.keyTime = time;
+	rec.keyData = 0;
+	fflush(stdout);
+}
+
+static void recIndex(void) {
+	uint64_t offset = rec.offset;
+	byte *buf = malloc(10 + 20 * rec.len);
+	if (!buf) err(EX_OSERR, "malloc");
+	size_t len = recVarint(buf, rec.len);
+	struct Key prev = {0};
+	for (size_t i = 0; i < rec.len; ++i) {
+		len += recVarint(&buf[len], rec.keys[i].time - prev.time);
+		len += recVarint(&buf[len], rec.keys[i].offset - prev.offset);
+		prev = rec.keys[i];
+	}
+	recFrame(RecIndex, rec.time, buf, len);
+	free(buf);
+	byte footer[8];
+	for (int i = 0; i < 8; ++i) {
+		footer[i] = offset >> (8 * i);
+	}
+	recPut(footer, sizeof(footer));
+	recPut(RecMagic, sizeof(RecMagic));
+	fflush(stdout);
+}
+
+static FILE *snap;
+
+static void snapshot(struct Term *term) {
+	static const struct TermHTML opts = { .bg = 0, .fg = 7 };
+	termHTML(snap, term, &opts);
+	int error = fflush(snap);
+	if (error) err(EX_IOERR, "fflush");
+}
+
+static volatile sig_atomic_t signalSnap;
+static void signalHandler(int signal) {
+	(void)signal;
+	signalSnap = 1;
+}
+
 int main(int argc, char *argv[]) {
+	setlocale(LC_CTYPE, "");
+
+	uint64_t keyInterval = 10;
+	int opt;
+	while (0 < (opt = getopt(argc, argv, "+k:o:t"))) {
+		switch (opt) {
+			break; case 'k': keyInterval = strtoull(optarg, NULL, 10);
+			break; case 'o': {
+				snap = fopen(optarg, "a");
+				if (!snap) err(EX_CANTCREAT, "%s", optarg);
+			}
+			break; case 't': rec.on = true;
+			break; default:  return EX_USAGE;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	if (argc < 2) return EX_USAGE;
 	if (isatty(STDOUT_FILENO)) errx(EX_USAGE, "stdout is not redirected");
 
@@ -66,6 +189,25 @@ int main(int argc, char *argv[]) {
 		err(EX_NOINPUT, "%s", argv[1]);
 	}
 
+	struct Term *term = termAlloc(window.ws_row, window.ws_col, false);
+	if (snap) signal(SIGUSR1, signalHandler);
+
+	// Key frames are drawn from only the output which was recorded.
+	struct Term *view = NULL;
+
+	if (rec.on) {
+		static char buf[64 * 1024];
+		setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+		byte size[20];
+		size_t len = recVarint(size, window.ws_row);
+		len += recVarint(&size[len], window.ws_col);
+		recPut(RecMagic, sizeof(RecMagic));
+		recFrame(RecSize, 0, size, len);
+		rec.start = now();
+		view = termAlloc(window.ws_row, window.ws_col, false);
+		recKey(view, 0);
+	}
+
 	bool stop = false;
 
 	byte buf[4096];
@@ -73,18 +215,38 @@ int main(int argc, char *argv[]) {
 		{ .events = POLLIN, .fd = STDIN_FILENO },
 		{ .events = POLLIN, .fd = pty },
 	};
-	while (0 < poll(fds, 2, -1)) {
+	for (;;) {
+		if (signalSnap) {
+			signalSnap = 0;
+			snapshot(term);
+		}
+		int nfds = poll(fds, 2, -1);
+		if (nfds < 0 && errno == EINTR) continue;
+		if (nfds < 0) err(EX_IOERR, "poll");
+
 		if (fds[0].revents & POLLIN) {
 			ssize_t rlen = read(STDIN_FILENO, buf, sizeof(buf));
 			if (rlen < 0) err(EX_IOERR, "read");
 
 			if (rlen == 1 && buf[0] == CTRL('S')) {
 				stop ^= true;
+				if (rec.on && !stop && termGround(view)) {
+					recKey(view, now() - rec.start);
+				}
+				continue;
+			}
+
+			if (rlen == 1 && buf[0] == CTRL('Q') && snap) {
+				snapshot(term);
 				continue;
 			}
 
 			if (rlen == 1 && buf[0] == CTRL('Q')) {
 				char dump[] = "\x1B[10i";
+				if (rec.on) {
+					recFrame(RecData, now() - rec.start, dump, sizeof(dump) - 1);
+					continue;
+				}
 				ssize_t wlen = write(STDOUT_FILENO, dump, sizeof(dump) - 1);
 				if (wlen < 0) err(EX_IOERR, "write");
 				continue;
@@ -101,7 +263,25 @@ int main(int argc, char *argv[]) {
 			ssize_t wlen = write(STDIN_FILENO, buf, rlen);
 			if (wlen < 0) err(EX_IOERR, "write");
 
-			if (!stop) {
+			// Keep the screen for snapshots even while stopped:
+			termWrite(term, (char *)buf, rlen);
+
+			if (rec.on) {
+				uint64_t time = now() - rec.start;
+				if (!stop) {
+					recFrame(RecData, time, buf, rlen);
+					termWrite(view, (char *)buf, rlen);
+					rec.keyData += rlen;
+				}
+				if (
+					!stop && (
+						time - rec.keyTime >= keyInterval * 1000000 ||
+						rec.keyData >= 1024 * 1024
+					)
+				) {
+					if (termGround(view)) recKey(view, time);
+				}
+			} else if (!stop) {
 				wlen = write(STDOUT_FILENO, buf, rlen);
 				if (wlen < 0) err(EX_IOERR, "write");
 			}
@@ -110,7 +290,9 @@ int main(int argc, char *argv[]) {
 		int status;
 		pid_t dead = waitpid(pid, &status, WNOHANG);
 		if (dead < 0) err(EX_OSERR, "waitpid");
-		if (dead) return WIFEXITED(status) ? WEXITSTATUS(status) : EX_SOFTWARE;
+		if (dead) {
+			if (rec.on) recIndex();
+			return WIFEXITED(status) ? WEXITSTATUS(status) : EX_SOFTWARE;
+		}
 	}
-	err(EX_IOERR, "poll");
 }
@@ -0,0 +1,77 @@
+/* Copyright (C) 2021  C. McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A recording is the magic followed by frames, each a type byte, the
+// microseconds since the previous frame and the payload length as variable
+// length integers, then the payload. Key frames hold control sequences which
+// draw the whole screen. A recording which was finished ends with an index
+// frame of the time and offset of each key frame, the offset of the index
+// frame as 8 bytes little-endian, and the magic again.
+
+static const char RecMagic[8] = "pteerec";
+
+enum {
+	RecSize = 's',
+	RecData = 'd',
+	RecKey = 'k',
+	RecIndex = 'i',
+};
+
+static inline size_t recVarint(uint8_t buf[static 10], uint64_t n) {
+	size_t len = 0;
+	do {
+		buf[len++] = (n & 0x7F) | (n > 0x7F ? 0x80 : 0);
+		n >>= 7;
+	} while (n);
+	return len;
+}
+
+static inline bool
+recGetVarint(const uint8_t **ptr, const uint8_t *end, uint64_t *n) {
+	*n = 0;
+	for (unsigned shift = 0; *ptr < end && shift < 64; shift += 7) {
+		uint8_t byte = *(*ptr)++;
+		*n |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return true;
+	}
+	return false;
+}
+
+struct RecFrame {
+	uint8_t type;
+	uint64_t time;
+	const uint8_t *ptr;
+	uint64_t len;
+};
+
+// Parse a frame at *ptr, adding its time to frame->time.
+static inline bool
+recGetFrame(const uint8_t **ptr, const uint8_t *end, struct RecFrame *frame) {
+	if (*ptr == end) return false;
+	frame->type = *(*ptr)++;
+	uint64_t delta;
+	if (!recGetVarint(ptr, end, &delta)) return false;
+	if (!recGetVarint(ptr, end, &frame->len)) return false;
+	if (frame->len > (uint64_t)(end - *ptr)) return false;
+	frame->time += delta;
+	frame->ptr = *ptr;
+	*ptr += frame->len;
+	return true;
+}
@@ -25,17 +25,24 @@
  * covered work.
  */
 
+#include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sysexits.h>
+#include <time.h>
 #include <tls.h>
 #include <unistd.h>
 
@@ -43,27 +50,232 @@
 #include <sys/capsicum.h>
 #endif
 
-static void clientWrite(struct tls *client, const char *ptr, size_t len) {
-	while (len) {
-		ssize_t ret = tls_write(client, ptr, len);
-		if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) continue;
+static struct tls *client;
+
+// Bytes queued for the server, and the poll events TLS is waiting on to read
+// or to write them.
+static struct {
+	char *ptr;
+	size_t len, cap;
+	short readWant;
+	short writeWant;
+} out;
+
+static short clientWant(ssize_t ret) {
+	return (ret == TLS_WANT_POLLOUT ? POLLOUT : POLLIN);
+}
+
+static void clientFlush(void) {
+	size_t sent = 0;
+	while (sent < out.len) {
+		ssize_t ret = tls_write(client, &out.ptr[sent], out.len - sent);
+		if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) {
+			out.writeWant = clientWant(ret);
+			break;
+		}
 		if (ret < 0) errx(EX_IOERR, "tls_write: %s", tls_error(client));
-		ptr += ret;
-		len -= ret;
+		sent += ret;
+	}
+	out.len -= sent;
+	memmove(out.ptr, &out.ptr[sent], out.len);
+	if (!out.len) out.writeWant = 0;
+}
+
+static void clientWrite(const char *ptr, size_t len) {
+	if (out.len + len > out.cap) {
+		if (!out.cap) out.cap = 4096;
+		while (out.len + len > out.cap) out.cap *= 2;
+		out.ptr = realloc(out.ptr, out.cap);
+		if (!out.ptr) err(EX_OSERR, "realloc");
 	}
+	memcpy(&out.ptr[out.len], ptr, len);
+	out.len += len;
+	if (!out.writeWant) clientFlush();
 }
 
-static void clientFormat(struct tls *client, const char *format, ...) {
+static void clientFormat(const char *format, ...) {
 	char buf[1024];
 	va_list ap;
 	va_start(ap, format);
 	int len = vsnprintf(buf, sizeof(buf), format, ap);
 	va_end(ap);
 	if ((size_t)len > sizeof(buf) - 1) errx(EX_DATAERR, "message too large");
-	clientWrite(client, buf, len);
+	clientWrite(buf, len);
+}
+
+static uint64_t now(void) {
+	struct timespec ts;
+	int error = clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (error) err(EX_OSERR, "clock_gettime");
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Channels are kept in an open addressing table of twice their number,
+// keyed by name without case.
+static struct Chan {
+	const char *name;
+	size_t max;
+} **chans;
+static size_t chansCap, chansLen;
+static struct Chan *chanDefault;
+
+static uint32_t chanHash(const char *name, size_t len) {
+	uint32_t hash = 2166136261;
+	for (size_t i = 0; i < len; ++i) {
+		hash = (hash ^ tolower((unsigned char)name[i])) * 16777619;
+	}
+	return hash;
+}
+
+static struct Chan **chanSlot(const char *name, size_t len) {
+	size_t i = chanHash(name, len) & (chansCap - 1);
+	for (; chans[i]; i = (i + 1) & (chansCap - 1)) {
+		const char *other = chans[i]->name;
+		if (!strncasecmp(other, name, len) && !other[len]) break;
+	}
+	return &chans[i];
+}
+
+static struct Chan *chanFind(const char *name, size_t len) {
+	return *chanSlot(name, len);
+}
+
+// Servers relay each NOTICE with a :nick!user@host prefix, which counts
+// against the 512 byte limit for its recipients. Leave room for a long one.
+enum { Prefix = 128 };
+
+static void chanAdd(const char *name) {
+	// Leave room for the NOTICE command around each line of input.
+	size_t room = 510 - Prefix - strlen("NOTICE  :");
+	if (strlen(name) >= room) errx(EX_USAGE, "%s: channel name too long", name);
+	struct Chan **slot = chanSlot(name, strlen(name));
+	if (*slot) return;
+	*slot = malloc(sizeof(**slot));
+	if (!*slot) err(EX_OSERR, "malloc");
+	(*slot)->name = name;
+	(*slot)->max = room - strlen(name);
+	if (!chanDefault) chanDefault = *slot;
+	chansLen++;
+}
+
+// With more than one channel, input lines starting with a channel name and
+// a space are sent there, and others to the first channel.
+static struct Chan *chanRoute(const char **ptr, size_t *len) {
+	if (chansLen < 2) return chanDefault;
+	const char *space = memchr(*ptr, ' ', *len);
+	if (!space) return chanDefault;
+	struct Chan *chan = chanFind(*ptr, space - *ptr);
+	if (!chan) return chanDefault;
+	*len -= &space[1] - *ptr;
+	*ptr = &space[1];
+	return chan;
+}
+
+// Lines from standard input wait in a queue to be sent within the penalty
+// rule of RFC 1459 section 8.10: each message moves a timer Penalty ahead,
+// and messages wait while the timer is Burst or more ahead of now.
+enum {
+	Penalty = 2000,
+	Burst = 10000,
+};
+
+static const char Separator[] = " | ";
+
+static struct {
+	struct Line {
+		struct Chan *chan;
+		char *text;
+	} *lines;
+	size_t head, len, cap;
+	bool merge;
+	bool ready;
+	uint64_t timer;
+	size_t sent, dropped;
+} queue;
+
+static struct Line *queueAt(size_t i) {
+	return &queue.lines[(queue.head + i) % queue.cap];
+}
+
+static bool
+queueFits(const struct Line *line, const struct Chan *chan, size_t len) {
+	if (line->chan != chan) return false;
+	return strlen(line->text) + strlen(Separator) + len <= chan->max;
+}
+
+static char *queueJoin(char *a, const char *b, size_t len) {
+	size_t prev = strlen(a);
+	a = realloc(a, prev + strlen(Separator) + len + 1);
+	if (!a) err(EX_OSERR, "realloc");
+	snprintf(
+		&a[prev], strlen(Separator) + len + 1, "%s%.*s",
+		Separator, (int)len, b
+	);
+	return a;
 }
 
-static void clientHandle(struct tls *client, const char *chan, char *line) {
+static void queuePush(const char *ptr, size_t len) {
+	struct Chan *chan = chanRoute(&ptr, &len);
+	if (len > chan->max) len = chan->max;
+	if (queue.len == queue.cap) {
+		struct Line *tail = queueAt(queue.len - 1);
+		if (queue.merge && queueFits(tail, chan, len)) {
+			tail->text = queueJoin(tail->text, ptr, len);
+			return;
+		}
+		free(queueAt(0)->text);
+		queue.head = (queue.head + 1) % queue.cap;
+		queue.len--;
+		queue.dropped++;
+	}
+	char *text = strndup(ptr, len);
+	if (!text) err(EX_OSERR, "strndup");
+	*queueAt(queue.len++) = (struct Line) { chan, text };
+}
+
+static void queuePenalty(uint64_t time) {
+	if (queue.timer < time) queue.timer = time;
+	queue.timer += Penalty;
+}
+
+static void queueSend(void) {
+	if (!queue.ready) return;
+	uint64_t time = now();
+	while (queue.len && queue.timer < time + Burst) {
+		struct Line line = *queueAt(0);
+		queue.head = (queue.head + 1) % queue.cap;
+		queue.len--;
+		while (queue.merge && queue.len) {
+			const struct Line *next = queueAt(0);
+			size_t len = strlen(next->text);
+			if (!queueFits(&line, next->chan, len)) break;
+			line.text = queueJoin(line.text, next->text, len);
+			free(next->text);
+			queue.head = (queue.head + 1) % queue.cap;
+			queue.len--;
+		}
+		clientFormat("NOTICE %s :%s\r\n", line.chan->name, line.text);
+		free(line.text);
+		queuePenalty(time);
+		queue.sent++;
+	}
+}
+
+// Milliseconds until the next message can be sent.
+static int queueWait(void) {
+	if (!queue.ready || !queue.len) return -1;
+	uint64_t time = now();
+	if (queue.timer < time + Burst) return 0;
+	return queue.timer - (time + Burst) + 1;
+}
+
+static volatile sig_atomic_t signalStats;
+static void signalHandler(int signal) {
+	(void)signal;
+	signalStats = 1;
+}
+
+static void clientHandle(char *line) {
 	char *prefix = NULL;
 	if (line[0] == ':') {
 		prefix = strsep(&line, " ") + 1;
@@ -71,10 +283,25 @@ static void clientHandle(struct tls *client, const char *chan, char *line) {
 	}
 
 	char *command = strsep(&line, " ");
-	if (!strcmp(command, "001") || !strcmp(command, "INVITE")) {
-		clientFormat(client, "JOIN :%s\r\n", chan);
+	if (!strcmp(command, "001")) {
+		for (size_t i = 0; i < chansCap; ++i) {
+			if (!chans[i]) continue;
+			clientFormat("JOIN :%s\r\n", chans[i]->name);
+			queuePenalty(now());
+		}
+		queue.ready = true;
+	} else if (!strcmp(command, "INVITE") && line) {
+		strsep(&line, " ");
+		if (line && line[0] == ':') line++;
+		struct Chan *chan = (line ? chanFind(line, strlen(line)) : NULL);
+		if (chan) {
+			clientFormat("JOIN :%s\r\n", chan->name);
+			queuePenalty(now());
+		}
+		return;
 	} else if (!strcmp(command, "PING")) {
-		clientFormat(client, "PONG %s\r\n", line);
+		clientFormat("PONG %s\r\n", line);
+		queuePenalty(now());
 	}
 	if (strcmp(command, "PRIVMSG") && strcmp(command, "NOTICE")) return;
 
@@ -83,11 +310,13 @@ static void clientHandle(struct tls *client, const char *chan, char *line) {
 
 	if (!line) errx(EX_PROTOCOL, "message without destination");
 	char *dest = strsep(&line, " ");
-	if (strcmp(dest, chan)) return;
+	struct Chan *chan = chanFind(dest, strlen(dest));
+	if (!chan) return;
 
 	if (!line || line[0] != ':') errx(EX_PROTOCOL, "message without message");
 	line = &line[1];
 
+	if (chansLen > 1) printf("%s ", chan->name);
 	if (!strncmp(line, "\1ACTION ", 8)) {
 		line = &line[8];
 		size_t len = strcspn(line, "\1");
@@ -109,14 +338,37 @@ static void limit(int fd, const cap_rights_t *rights) {
 int main(int argc, char *argv[]) {
 	int error;
 
-	if (argc < 5) return EX_USAGE;
-	const char *host = argv[1];
-	const char *port = argv[2];
-	const char *nick = argv[3];
-	const char *chan = argv[4];
+	queue.cap = 256;
+	for (int opt; 0 < (opt = getopt(argc, argv, "cq:"));) {
+		switch (opt) {
+			break; case 'c': queue.merge = true;
+			break; case 'q': queue.cap = strtoul(optarg, NULL, 10);
+			break; default:  return EX_USAGE;
+		}
+	}
+	if (argc - optind < 4) return EX_USAGE;
+	if (!queue.cap) errx(EX_USAGE, "queue limit must be positive");
+	const char *host = argv[optind + 0];
+	const char *port = argv[optind + 1];
+	const char *nick = argv[optind + 2];
+
+	chansCap = 2;
+	while (chansCap < 2 * (size_t)(argc - optind - 3)) chansCap *= 2;
+	chans = calloc(chansCap, sizeof(*chans));
+	if (!chans) err(EX_OSERR, "calloc");
+	for (int i = optind + 3; i < argc; ++i) {
+		chanAdd(argv[i]);
+	}
+
+	queue.lines = calloc(queue.cap, sizeof(*queue.lines));
+	if (!queue.lines) err(EX_OSERR, "calloc");
 
 	setlinebuf(stdout);
 	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, signalHandler);
+#ifdef SIGINFO
+	signal(SIGINFO, signalHandler);
+#endif
 
 	struct tls_config *config = tls_config_new();
 	if (!config) errx(EX_SOFTWARE, "tls_config_new");
@@ -126,7 +378,7 @@ int main(int argc, char *argv[]) {
 		errx(EX_SOFTWARE, "tls_config_set_ciphers: %s", tls_config_error(config));
 	}
 
-	struct tls *client = tls_client();
+	client = tls_client();
 	if (!client) errx(EX_SOFTWARE, "tls_client");
 
 	error = tls_configure(client, config);
@@ -156,6 +408,9 @@ int main(int argc, char *argv[]) {
 	if (sock < 0) err(EX_UNAVAILABLE, "connect");
 	freeaddrinfo(head);
 
+	error = fcntl(sock, F_SETFL, O_NONBLOCK);
+	if (error) err(EX_OSERR, "fcntl");
+
 	error = tls_connect_socket(client, sock, host);
 	if (error) errx(EX_PROTOCOL, "tls_connect: %s", tls_error(client));
 
@@ -175,44 +430,105 @@ int main(int argc, char *argv[]) {
 	limit(sock, &rights);
 #endif
 
-	clientFormat(client, "NICK :%s\r\nUSER %s 0 * :%s\r\n", nick, nick, nick);
+	clientFormat("NICK :%s\r\nUSER %s 0 * :%s\r\n", nick, nick, nick);
 
-	char *input = NULL;
-	size_t cap = 0;
+	char input[4096];
+	size_t inputLen = 0;
+	bool discard = false;
+	bool quit = false;
 
 	char buf[4096];
 	size_t len = 0;
 
 	struct pollfd fds[2] = {
-		{ .events = POLLIN, .fd = STDIN_FILENO },
-		{ .events = POLLIN, .fd = sock },
+		{ .fd = STDIN_FILENO },
+		{ .fd = sock },
 	};
-	while (0 < poll(fds, 2, -1)) {
+	for (;;) {
+		if (signalStats) {
+			signalStats = 0;
+			warnx(
+				"%zu queued, %zu sent, %zu dropped",
+				queue.len, queue.sent, queue.dropped
+			);
+		}
+		queueSend();
+
+		// Quit once everything read before EOF has been sent.
+		if (fds[0].fd < 0 && !queue.len && !quit) {
+			clientFormat("QUIT\r\n");
+			quit = true;
+		}
+		if (quit && !out.len) return EX_OK;
+
+		fds[0].events = POLLIN;
+		fds[1].events = POLLIN | out.readWant | out.writeWant;
+		int nfds = poll(fds, 2, queueWait());
+		if (nfds < 0 && errno == EINTR) continue;
+		if (nfds < 0) err(EX_IOERR, "poll");
+
 		if (fds[0].revents) {
-			ssize_t len = getline(&input, &cap, stdin);
-			if (len < 0) err(EX_IOERR, "getline");
-			input[len - 1] = '\0';
-			clientFormat(client, "NOTICE %s :%s\r\n", chan, input);
+			ssize_t size = read(
+				STDIN_FILENO, &input[inputLen], sizeof(input) - inputLen
+			);
+			if (size < 0) err(EX_IOERR, "read");
+			inputLen += size;
+			if (!size) {
+				fds[0].fd = -1;
+				if (inputLen) input[inputLen++] = '\n';
+			}
+
+			char *nl;
+			char *line = input;
+			for (;;) {
+				nl = memchr(line, '\n', &input[inputLen] - line);
+				if (!nl) break;
+				if (!discard) queuePush(line, nl - line);
+				discard = false;
+				line = &nl[1];
+			}
+			inputLen -= line - input;
+			memmove(input, line, inputLen);
+
+			// Lines are truncated to fit a message anyway, so send the start
+			// of a line too long to buffer and discard the rest of it.
+			if (inputLen == sizeof(input)) {
+				if (!discard) queuePush(input, inputLen);
+				discard = true;
+				inputLen = 0;
+			}
 		}
-		if (!fds[1].revents) continue;
-
-		ssize_t read = tls_read(client, &buf[len], sizeof(buf) - len);
-		if (read == TLS_WANT_POLLIN || read == TLS_WANT_POLLOUT) continue;
-		if (read < 0) errx(EX_IOERR, "tls_read: %s", tls_error(client));
-		if (!read) return EX_UNAVAILABLE;
-		len += read;
-
-		char *crlf;
-		char *line = buf;
-		for (;;) {
-			crlf = memmem(line, &buf[len] - line, "\r\n", 2);
-			if (!crlf) break;
-			crlf[0] = '\0';
-			clientHandle(client, chan, line);
-			line = &crlf[2];
+
+		if (fds[1].revents) {
+			out.readWant = 0;
+			// TLS may hold decrypted data the socket does not show, so read
+			// until it wants more.
+			for (;;) {
+				ssize_t read = tls_read(client, &buf[len], sizeof(buf) - len);
+				if (read == TLS_WANT_POLLIN || read == TLS_WANT_POLLOUT) {
+					if (read == TLS_WANT_POLLOUT) out.readWant = POLLOUT;
+					break;
+				}
+				if (read < 0) errx(EX_IOERR, "tls_read: %s", tls_error(client));
+				if (!read) return (quit ? EX_OK : EX_UNAVAILABLE);
+				len += read;
+
+				char *crlf;
+				char *line = buf;
+				for (;;) {
+					crlf = memmem(line, &buf[len] - line, "\r\n", 2);
+					if (!crlf) break;
+					crlf[0] = '\0';
+					clientHandle(line);
+					line = &crlf[2];
+				}
+				if (line == buf && len == sizeof(buf)) {
+					errx(EX_PROTOCOL, "line too long");
+				}
+				len -= line - buf;
+				memmove(buf, line, len);
+			}
+			if (out.len) clientFlush();
 		}
-		len -= line - buf;
-		memmove(buf, line, len);
 	}
-	err(EX_IOERR, "poll");
 }
@@ -0,0 +1,114 @@
+#!/usr/bin/env perl
+use strict;
+use warnings;
+use File::Temp qw(tempdir);
+use IO::Select;
+use IO::Socket::INET;
+use IPC::Open2 qw(open2);
+use Socket qw(SOL_SOCKET SO_RCVBUF);
+use Time::HiRes qw(sleep time);
+
+# Check that relay idles while the server stops reading from it:
+# relaybench.pl [-c cert.pem] [-l percent] [-n pings] [-p port] [-t secs] relay
+# The server is openssl s_server behind a proxy, which stops reading from
+# relay once it has registered and then passes it PINGs, so that its PONGs
+# fill the socket and back up in its write queue. relay must trust the
+# certificate. Without -c, one is made for localhost in SSL_CERT_FILE.
+my %opts;
+while (@ARGV && $ARGV[0] =~ /^-([clnpt])$/) {
+	shift;
+	$opts{$1} = shift;
+}
+my ($relay) = @ARGV;
+die "usage: $0 [-c cert] [-l percent] [-n pings] [-p port] [-t secs] relay\n"
+	unless $relay;
+my $limit = ($opts{l} // 10) / 100;
+my $pings = $opts{n} // 40000;
+my $port = $opts{p} // 6697;
+my $secs = $opts{t} // 8;
+
+my $cert = $opts{c};
+unless ($cert) {
+	my $dir = tempdir(CLEANUP => 1);
+	$cert = "$dir/cert.pem";
+	system(
+		"openssl req -x509 -newkey rsa:2048 -nodes -days 1 " .
+		"-subj /CN=localhost -addext subjectAltName=DNS:localhost " .
+		"-keyout $cert -out $cert 2>/dev/null"
+	) == 0 or die "openssl req failed\n";
+	$ENV{SSL_CERT_FILE} = $cert;
+}
+
+my $server = open2(
+	my $from, my $to,
+	"openssl s_server -quiet -naccept 1 -accept " . ($port + 1) .
+	" -cert $cert"
+);
+$to->autoflush(1);
+
+# A small receive buffer leaves relay's writes nowhere to go:
+my $listen = IO::Socket::INET->new(
+	LocalAddr => '127.0.0.1', LocalPort => $port, Listen => 1, ReuseAddr => 1,
+) or die "listen: $!\n";
+setsockopt($listen, SOL_SOCKET, SO_RCVBUF, 4096);
+sleep 0.5;
+
+# relay exits at the end of its input, so hold it open:
+pipe my $input, my $hold or die "pipe: $!\n";
+my (undef, undef, $user0, $sys0) = times;
+my $pid = fork // die "fork: $!\n";
+if (!$pid) {
+	open STDIN, '<&', $input or die "stdin: $!\n";
+	open STDOUT, '>', '/dev/null' or die "/dev/null: $!\n";
+	exec $relay, 'localhost', $port, 'relay', '#bench' or die "$relay: $!\n";
+}
+
+my $client = $listen->accept or die "accept: $!\n";
+my $upstream = IO::Socket::INET->new(
+	PeerAddr => '127.0.0.1', PeerPort => $port + 1,
+) or die "connect: $!\n";
+
+my ($writer, $start, $passed);
+my $select = IO::Select->new($client, $upstream, $from);
+while (!$start || time - $start < $secs) {
+	for my $fh ($select->can_read(0.1)) {
+		my $n = sysread $fh, my $buf, 65536;
+		if (!$n) {
+			die "relay exited\n" if $fh == $client;
+			$select->remove($fh);
+			next;
+		}
+		if ($fh == $client) {
+			syswrite $upstream, $buf;
+		} elsif ($fh == $upstream) {
+			syswrite $client, $buf;
+			$passed += $n if $start;
+		} elsif (!$start && $buf =~ /^USER /m) {
+			print $to ":irc 001 relay :Welcome\r\n";
+			$select->remove($client);
+			$start = time;
+			$writer = fork // die "fork: $!\n";
+			if (!$writer) {
+				my $token = 'x' x 400;
+				print $to "PING :$token\r\n" for 1 .. $pings;
+				exit;
+			}
+		}
+	}
+}
+my $wall = time - $start;
+kill 'TERM', $pid;
+waitpid $pid, 0;
+my (undef, undef, $user, $sys) = times;
+kill 'TERM', $writer, $server;
+waitpid $writer, 0;
+waitpid $server, 0;
+
+my $cpu = $user - $user0 + $sys - $sys0;
+printf "%8s %8s %8s\n", qw(passed wall cpu);
+printf "%6.1fMB %8.2f %8.2f", ($passed // 0) / 1e6, $wall, $cpu;
+if ($cpu > $limit * $wall) {
+	print " BUSY\n";
+	exit 1;
+}
+print "\n";
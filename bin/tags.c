@@ -0,0 +1,341 @@
+/* Copyright (C) 2021  C. McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include "tags.h"
+
+const regex_t *tagsRule(const char *name) {
+	static bool compiled;
+	static regex_t makeFile, makeLine;
+	static regex_t mdocFile, mdocLine;
+	static regex_t shFile, shLine;
+	if (!compiled) {
+		int error = 0
+			|| regcomp(&makeFile, "(^|/)Makefile|[.]mk$", REG_EXTENDED | REG_NOSUB)
+			|| regcomp(
+				&makeLine,
+				"^([.][^:$A-Z][^:$[:space:]]*|[^.:$][^:$[:space:]]*):",
+				REG_EXTENDED
+			)
+			|| regcomp(&mdocFile, "[.][1-9]$", REG_EXTENDED | REG_NOSUB)
+			|| regcomp(&mdocLine, "^[.]S[hs] ([^\t\n]+)", REG_EXTENDED)
+			|| regcomp(
+				&shFile, "(^|/)[.](profile|shrc)|[.]sh$", REG_EXTENDED | REG_NOSUB
+			)
+			|| regcomp(&shLine, "^([_[:alnum:]]+)[[:blank:]]*[(][)]", REG_EXTENDED);
+		assert(!error);
+		compiled = true;
+	}
+	if (!regexec(&makeFile, name, 0, NULL, 0)) return &makeLine;
+	if (!regexec(&mdocFile, name, 0, NULL, 0)) return &mdocLine;
+	if (!regexec(&shFile, name, 0, NULL, 0)) return &shLine;
+	return NULL;
+}
+
+static char *nomagic(const char *pattern) {
+	char *buf = malloc(2 * strlen(pattern) + 1);
+	if (!buf) err(EX_OSERR, "malloc");
+	char *ptr = buf;
+	for (const char *ch = pattern; *ch; ++ch) {
+		if (strchr(".[*", *ch)) *ptr++ = '\\';
+		*ptr++ = *ch;
+	}
+	*ptr = '\0';
+	return buf;
+}
+
+static const size_t None = SIZE_MAX;
+
+static size_t len;
+static size_t cap;
+static struct Tag {
+	char *tag;
+	int num;
+	enum Kind {
+		Number,
+		Line,
+		Prefix,
+		Regex,
+	} kind;
+	char *text;
+	size_t len;
+	size_t next;
+	regex_t regex;
+} *tags;
+
+static struct Tag *push(const char *tag, size_t tagLen) {
+	if (len == cap) {
+		cap = (cap ? cap * 2 : 256);
+		tags = realloc(tags, cap * sizeof(*tags));
+		if (!tags) err(EX_OSERR, "realloc");
+	}
+	struct Tag *ptr = &tags[len];
+	ptr->tag = strndup(tag, tagLen);
+	if (!ptr->tag) err(EX_OSERR, "strndup");
+	ptr->num = 0;
+	return ptr;
+}
+
+// Parse a search pattern which is only an anchored literal line or line
+// prefix, as written by ctags and mtags.
+static bool literal(struct Tag *tag, const char *def) {
+	if (def[0] != '^') return false;
+	tag->kind = Prefix;
+	tag->text = malloc(strlen(def));
+	if (!tag->text) err(EX_OSERR, "malloc");
+	tag->len = 0;
+	for (const char *ch = &def[1]; *ch; ++ch) {
+		if (ch[0] == '$' && !ch[1]) {
+			tag->kind = Line;
+		} else if (ch[0] == '\\' && ch[1] && strchr("\\/", ch[1])) {
+			tag->text[tag->len++] = *++ch;
+		} else if (ch[0] == '\\') {
+			free(tag->text);
+			return false;
+		} else {
+			tag->text[tag->len++] = *ch;
+		}
+	}
+	return true;
+}
+
+void tagsAdd(const char *tag, char *def) {
+	struct Tag *ptr = push(tag, strlen(tag));
+	if (def[0] == '/' || def[0] == '?') {
+		def++;
+		def[strlen(def)-1] = '\0';
+		if (literal(ptr, def)) {
+			len++;
+			return;
+		}
+		ptr->kind = Regex;
+		char *search = nomagic(def);
+		int error = regcomp(&ptr->regex, search, REG_NEWLINE | REG_NOSUB);
+		free(search);
+		if (error) {
+			warnx("invalid regex for tag %s: %s", tag, def);
+			return;
+		}
+	} else {
+		ptr->kind = Number;
+		ptr->num = strtol(def, &def, 10);
+		if (*def) {
+			warnx("invalid line number for tag %s: %s", tag, def);
+			return;
+		}
+	}
+	len++;
+}
+
+bool tagsScan(const char *name, const char *buf, size_t bufLen) {
+	const regex_t *regex = tagsRule(name);
+	if (!regex) return false;
+	char *line = NULL;
+	size_t lineCap = 0;
+	for (size_t pos = 0; pos < bufLen;) {
+		const char *end = memchr(&buf[pos], '\n', bufLen - pos);
+		size_t n = (end ? (size_t)(end - &buf[pos]) + 1 : bufLen - pos);
+		if (lineCap < n + 1) {
+			line = realloc(line, (lineCap = n + 1));
+			if (!line) err(EX_OSERR, "realloc");
+		}
+		memcpy(line, &buf[pos], n);
+		line[n] = '\0';
+		pos += n;
+
+		regmatch_t match[2];
+		if (regexec(regex, line, 2, match, 0)) continue;
+		struct Tag *tag = push(
+			&line[match[1].rm_so], match[1].rm_eo - match[1].rm_so
+		);
+		tag->kind = Prefix;
+		tag->text = strndup(line, match[0].rm_eo);
+		if (!tag->text) err(EX_OSERR, "strndup");
+		tag->len = match[0].rm_eo;
+		len++;
+	}
+	free(line);
+	return true;
+}
+
+void tagsRead(const char *file, const char *buf, size_t bufLen) {
+	char *copy = NULL;
+	size_t copyCap = 0;
+	for (size_t pos = 0; pos < bufLen;) {
+		const char *end = memchr(&buf[pos], '\n', bufLen - pos);
+		size_t n = (end ? (size_t)(end - &buf[pos]) : bufLen - pos);
+		if (copyCap < n + 2) {
+			copy = realloc(copy, (copyCap = n + 2));
+			if (!copy) err(EX_OSERR, "realloc");
+		}
+		memcpy(copy, &buf[pos], n);
+		copy[n] = '\n';
+		copy[n+1] = '\0';
+		pos += n + 1;
+
+		char *line = copy;
+		char *tag = strsep(&line, "\t");
+		char *name = strsep(&line, "\t");
+		char *def = strsep(&line, "\n");
+		if (!tag || !name || !def) errx(EX_DATAERR, "malformed tags file");
+		if (!strcmp(name, file)) tagsAdd(tag, def);
+	}
+	free(copy);
+}
+
+// Literal patterns are found by FNV-1a hash, which can be computed over
+// each line once while checking every prefix length in use.
+static const uint64_t Basis = 0xCBF29CE484222325;
+static uint64_t hash(uint64_t h, char ch) {
+	return (h ^ (unsigned char)ch) * 0x100000001B3;
+}
+
+static struct Entry {
+	uint64_t hash;
+	size_t first;
+	size_t last;
+	size_t head;
+} *table;
+static size_t tableCap;
+
+static struct Entry *
+lookup(uint64_t h, enum Kind kind, const char *text, size_t len) {
+	for (size_t i = h & (tableCap - 1);; i = (i + 1) & (tableCap - 1)) {
+		struct Entry *entry = &table[i];
+		if (entry->first == None) return entry;
+		if (entry->hash != h) continue;
+		const struct Tag *tag = &tags[entry->first];
+		if (tag->kind != kind || tag->len != len) continue;
+		if (!memcmp(tag->text, text, len)) return entry;
+	}
+}
+
+static int compareNum(const void *_a, const void *_b) {
+	const size_t *a = _a, *b = _b;
+	if (tags[*a].num != tags[*b].num) return tags[*a].num - tags[*b].num;
+	return (*a > *b) - (*a < *b);
+}
+
+static int compareSize(const void *_a, const void *_b) {
+	const size_t *a = _a, *b = _b;
+	return (*a > *b) - (*a < *b);
+}
+
+static size_t *nums, numsLen, nextNum;
+static size_t *regexes, regexesLen;
+static size_t *prefixes, prefixesLen;
+
+void tagsIndex(void) {
+	nums = calloc(len + 1, sizeof(*nums));
+	regexes = calloc(len + 1, sizeof(*regexes));
+	prefixes = calloc(len + 1, sizeof(*prefixes));
+	if (!nums || !regexes || !prefixes) err(EX_OSERR, "calloc");
+
+	for (tableCap = 16; tableCap < 2 * len; tableCap *= 2);
+	table = malloc(tableCap * sizeof(*table));
+	if (!table) err(EX_OSERR, "malloc");
+	for (size_t i = 0; i < tableCap; ++i) {
+		table[i].first = None;
+	}
+
+	for (size_t i = 0; i < len; ++i) {
+		struct Tag *tag = &tags[i];
+		tag->next = None;
+		if (tag->kind == Number) {
+			nums[numsLen++] = i;
+			continue;
+		}
+		if (tag->kind == Regex) {
+			regexes[regexesLen++] = i;
+			continue;
+		}
+		if (tag->kind == Prefix) prefixes[prefixesLen++] = tag->len;
+		uint64_t h = Basis;
+		for (size_t j = 0; j < tag->len; ++j) {
+			h = hash(h, tag->text[j]);
+		}
+		struct Entry *entry = lookup(h, tag->kind, tag->text, tag->len);
+		if (entry->first == None) {
+			*entry = (struct Entry) { h, i, i, i };
+		} else {
+			tags[entry->last].next = i;
+			entry->last = i;
+		}
+	}
+	qsort(nums, numsLen, sizeof(*nums), compareNum);
+	qsort(prefixes, prefixesLen, sizeof(*prefixes), compareSize);
+	size_t uniq = 0;
+	for (size_t i = 0; i < prefixesLen; ++i) {
+		if (!uniq || prefixes[i] != prefixes[uniq-1]) {
+			prefixes[uniq++] = prefixes[i];
+		}
+	}
+	prefixesLen = uniq;
+}
+
+// Each tag matches only its first line, and each line only its first tag.
+// Tags sharing a literal pattern are used up in order.
+const char *tagsMatch(int num, const char *line, size_t n) {
+	size_t best = None;
+	struct Entry *used = NULL;
+
+	while (nextNum < numsLen && tags[nums[nextNum]].num < num) nextNum++;
+	if (nextNum < numsLen && tags[nums[nextNum]].num == num) {
+		best = nums[nextNum];
+	}
+
+	size_t lineLen = n - (n && line[n-1] == '\n');
+	uint64_t h = Basis;
+	for (size_t i = 0, p = 0;; ++i) {
+		if (p < prefixesLen && prefixes[p] == i) {
+			struct Entry *entry = lookup(h, Prefix, line, i);
+			if (entry->first != None && entry->head < best) {
+				best = entry->head;
+				used = entry;
+			}
+			p++;
+		}
+		if (i == lineLen) break;
+		h = hash(h, line[i]);
+	}
+	struct Entry *entry = lookup(h, Line, line, lineLen);
+	if (entry->first != None && entry->head < best) {
+		best = entry->head;
+		used = entry;
+	}
+
+	for (size_t i = 0; i < regexesLen && regexes[i] < best; ++i) {
+		struct Tag *tag = &tags[regexes[i]];
+		if (tag->num) continue;
+		if (regexec(&tag->regex, line, 0, NULL, 0)) continue;
+		tag->num = num;
+		best = regexes[i];
+		used = NULL;
+		break;
+	}
+
+	if (best == None) return NULL;
+	if (used) used->head = tags[best].next;
+	return tags[best].tag;
+}
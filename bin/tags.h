@@ -0,0 +1,37 @@
+/* Copyright (C) 2021  C. McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <regex.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Return the mtags rule for lines of a file by its name, or NULL. Group 1 of
+// a match is the tag, and the match is the line prefix it is found by.
+const regex_t *tagsRule(const char *name);
+
+// Add a tag by its ctags search pattern or line number.
+void tagsAdd(const char *tag, char *def);
+
+// Add tags for the lines of buf by the mtags rule for name.
+bool tagsScan(const char *name, const char *buf, size_t len);
+
+// Add tags for file from the contents of a tags file.
+void tagsRead(const char *file, const char *buf, size_t len);
+
+// Index the added tags, then match lines in order. Lines must be terminated
+// by a NUL after any newline.
+void tagsIndex(void);
+const char *tagsMatch(int num, const char *line, size_t len);
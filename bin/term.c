@@ -0,0 +1,790 @@
+/* Copyright (C) 2019  C. McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <wchar.h>
+
+#include "term.h"
+
+#define BIT(x) x##Bit, x = 1 << x##Bit, x##Bit_ = x##Bit
+
+typedef unsigned uint;
+
+enum {
+	NUL, SOH, STX, ETX, EOT, ENQ, ACK, BEL,
+	BS, HT, NL, VT, NP, CR, SO, SI,
+	DLE, DC1, DC2, DC3, DC4, NAK, SYN, ETB,
+	CAN, EM, SUB, ESC, FS, GS, RS, US,
+	DEL = 0x7F,
+};
+
+enum Attr {
+	BIT(Bold),
+	BIT(Dim),
+	BIT(Italic),
+	BIT(Underline),
+	BIT(Blink),
+	BIT(Reverse),
+};
+
+struct Style {
+	enum Attr attr;
+	int bg, fg;
+};
+
+struct Cell {
+	struct Style style;
+	wchar_t ch;
+};
+
+enum Mode {
+	BIT(Insert),
+	BIT(Wrap),
+	BIT(Cursor),
+	BIT(AppCursor),
+	BIT(AppKeypad),
+	BIT(AltScreen),
+	BIT(MouseClick),
+	BIT(MouseDrag),
+	BIT(MouseMove),
+	BIT(MouseSGR),
+	BIT(Paste),
+};
+
+enum { ParamCap = 16 };
+
+enum State {
+	Data,
+	Esc,
+	G0,
+	CSI,
+	CSILt,
+	CSIEq,
+	CSIGt,
+	CSIQm,
+	CSIInter,
+	OSC,
+	OSCEsc,
+};
+
+struct Term {
+	uint rows, cols;
+	struct Cell *cells;
+	uint y, x;
+	struct Style style;
+	struct {
+		uint y, x;
+	} save;
+	struct {
+		uint s[ParamCap];
+		uint n, i;
+	} param;
+	struct {
+		uint top, bot;
+	} scroll;
+	enum Mode mode;
+	enum {
+		USASCII,
+		DECSpecial,
+	} charset;
+	enum State state;
+	bool mediaCopy;
+	bool warn;
+	mbstate_t mbs;
+};
+
+// The terminal being updated.
+static struct Term *t;
+
+static struct Cell *cell(uint y, uint x) {
+	assert(y <= t->rows);
+	assert(x <= t->cols);
+	assert(y * t->cols + x <= t->rows * t->cols);
+	return &t->cells[y * t->cols + x];
+}
+
+#define unhandled(...) do { if (t->warn) warnx(__VA_ARGS__); } while (0)
+
+static uint p(uint i, uint z) {
+	return (i < t->param.n ? t->param.s[i] : z);
+}
+
+static uint min(uint a, uint b) {
+	return (a < b ? a : b);
+}
+
+#define _ch ch __attribute__((unused))
+typedef void Action(wchar_t ch);
+
+static void nop(wchar_t _ch) {
+}
+
+static void csi(wchar_t _ch) {
+	memset(&t->param, 0, sizeof(t->param));
+}
+
+static void csiSep(wchar_t _ch) {
+	if (t->param.n == ParamCap) return;
+	if (!t->param.n) t->param.n++;
+	t->param.n++;
+	t->param.i++;
+}
+
+static void csiDigit(wchar_t ch) {
+	t->param.s[t->param.i] *= 10;
+	t->param.s[t->param.i] += ch - L'0';
+	if (!t->param.n) t->param.n++;
+}
+
+static void bs(wchar_t _ch)  { if (t->x) t->x--; }
+static void ht(wchar_t _ch)  { t->x = min(t->x - t->x % 8 + 8, t->cols - 1); }
+static void cr(wchar_t _ch)  { t->x = 0; }
+static void cuu(wchar_t _ch) { t->y -= min(p(0, 1), t->y); }
+static void cud(wchar_t _ch) { t->y  = min(t->y + p(0, 1), t->rows - 1); }
+static void cuf(wchar_t _ch) { t->x  = min(t->x + p(0, 1), t->cols - 1); }
+static void cub(wchar_t _ch) { t->x -= min(p(0, 1), t->x); }
+static void cnl(wchar_t _ch) { t->x = 0; cud(0); }
+static void cpl(wchar_t _ch) { t->x = 0; cuu(0); }
+static void cha(wchar_t _ch) { t->x = min(p(0, 1) - 1, t->cols - 1); }
+static void vpa(wchar_t _ch) { t->y = min(p(0, 1) - 1, t->rows - 1); }
+static void cup(wchar_t _ch) {
+	t->y = min(p(0, 1) - 1, t->rows - 1);
+	t->x = min(p(1, 1) - 1, t->cols - 1);
+}
+static void decsc(wchar_t _ch) {
+	t->save.y = t->y;
+	t->save.x = t->x;
+}
+static void decrc(wchar_t _ch) {
+	t->y = t->save.y;
+	t->x = t->save.x;
+}
+
+static void move(struct Cell *dst, struct Cell *src, size_t len) {
+	memmove(dst, src, sizeof(*dst) * len);
+}
+
+static void erase(struct Cell *at, struct Cell *to) {
+	for (; at < to; ++at) {
+		at->style = t->style;
+		at->ch = L' ';
+	}
+}
+
+static void ed(wchar_t _ch) {
+	erase(
+		(p(0, 0) == 0 ? cell(t->y, t->x) : cell(0, 0)),
+		(p(0, 0) == 1 ? cell(t->y, t->x) : cell(t->rows - 1, t->cols))
+	);
+}
+static void el(wchar_t _ch) {
+	erase(
+		(p(0, 0) == 0 ? cell(t->y, t->x) : cell(t->y, 0)),
+		(p(0, 0) == 1 ? cell(t->y, t->x) : cell(t->y, t->cols))
+	);
+}
+static void ech(wchar_t _ch) {
+	erase(cell(t->y, t->x), cell(t->y, min(t->x + p(0, 1), t->cols)));
+}
+
+static void dch(wchar_t _ch) {
+	uint n = min(p(0, 1), t->cols - t->x);
+	move(cell(t->y, t->x), cell(t->y, t->x + n), t->cols - t->x - n);
+	erase(cell(t->y, t->cols - n), cell(t->y, t->cols));
+}
+static void ich(wchar_t _ch) {
+	uint n = min(p(0, 1), t->cols - t->x);
+	move(cell(t->y, t->x + n), cell(t->y, t->x), t->cols - t->x - n);
+	erase(cell(t->y, t->x), cell(t->y, t->x + n));
+}
+
+static void scrollUp(uint top, uint n) {
+	uint bot = t->scroll.bot;
+	n = min(n, bot - top);
+	move(cell(top, 0), cell(top + n, 0), t->cols * (bot - top - n));
+	erase(cell(bot - n, 0), cell(bot, 0));
+}
+
+static void scrollDown(uint top, uint n) {
+	uint bot = t->scroll.bot;
+	n = min(n, bot - top);
+	move(cell(top + n, 0), cell(top, 0), t->cols * (bot - top - n));
+	erase(cell(top, 0), cell(top + n, 0));
+}
+
+static void decstbm(wchar_t _ch) {
+	t->scroll.bot = min(p(1, t->rows), t->rows);
+	t->scroll.top = min(p(0, 1) - 1, t->scroll.bot);
+}
+
+static void su(wchar_t _ch) { scrollUp(t->scroll.top, p(0, 1)); }
+static void sd(wchar_t _ch) { scrollDown(t->scroll.top, p(0, 1)); }
+static void dl(wchar_t _ch) { scrollUp(min(t->y, t->scroll.bot), p(0, 1)); }
+static void il(wchar_t _ch) { scrollDown(min(t->y, t->scroll.bot), p(0, 1)); }
+
+static void nl(wchar_t _ch) {
+	if (t->y + 1 == t->scroll.bot) {
+		scrollUp(t->scroll.top, 1);
+	} else {
+		t->y = min(t->y + 1, t->rows - 1);
+	}
+}
+static void ri(wchar_t _ch) {
+	if (t->y == t->scroll.top) {
+		scrollDown(t->scroll.top, 1);
+	} else {
+		if (t->y) t->y--;
+	}
+}
+
+static enum Mode paramMode(void) {
+	enum Mode mode = 0;
+	for (uint i = 0; i < t->param.n; ++i) {
+		switch (t->param.s[i]) {
+			break; case 4: mode |= Insert;
+			break; default: unhandled("unhandled SM/RM %u", t->param.s[i]);
+		}
+	}
+	return mode;
+}
+
+static enum Mode paramDECMode(void) {
+	enum Mode mode = 0;
+	for (uint i = 0; i < t->param.n; ++i) {
+		switch (t->param.s[i]) {
+			break; case 1: mode |= AppCursor;
+			break; case 7: mode |= Wrap;
+			break; case 12: // "Start Blinking Cursor"
+			break; case 25: mode |= Cursor;
+			break; case 47: mode |= AltScreen;
+			break; case 1000: mode |= MouseClick;
+			break; case 1002: mode |= MouseDrag;
+			break; case 1003: mode |= MouseMove;
+			break; case 1006: mode |= MouseSGR;
+			break; case 1047: mode |= AltScreen;
+			break; case 1049: mode |= AltScreen;
+			break; case 2004: mode |= Paste;
+			break; default: {
+				if (t->param.s[i] < 1000) {
+					unhandled("unhandled DECSET/DECRST %u", t->param.s[i]);
+				}
+			}
+		}
+	}
+	return mode;
+}
+
+static void sm(wchar_t _ch) { t->mode |= paramMode(); }
+static void rm(wchar_t _ch) { t->mode &= ~paramMode(); }
+static void decset(wchar_t _ch) { t->mode |= paramDECMode(); }
+static void decrst(wchar_t _ch) { t->mode &= ~paramDECMode(); }
+static void deckpam(wchar_t _ch) { t->mode |= AppKeypad; }
+static void deckpnm(wchar_t _ch) { t->mode &= ~AppKeypad; }
+
+enum {
+	Reset,
+	SetBold,
+	SetDim,
+	SetItalic,
+	SetUnderline,
+	SetBlink,
+	SetReverse = 7,
+
+	UnsetBoldDim = 22,
+	UnsetItalic,
+	UnsetUnderline,
+	UnsetBlink,
+	UnsetReverse = 27,
+
+	SetFg0 = 30,
+	SetFg7 = 37,
+	SetFg,
+	ResetFg,
+	SetBg0 = 40,
+	SetBg7 = 47,
+	SetBg,
+	ResetBg,
+
+	SetFg8 = 90,
+	SetFgF = 97,
+	SetBg8 = 100,
+	SetBgF = 107,
+
+	Color256 = 5,
+};
+
+static void sgr(wchar_t _ch) {
+	struct Style *style = &t->style;
+	uint n = t->param.i + 1;
+	for (uint i = 0; i < n; ++i) {
+		switch (t->param.s[i]) {
+			break; case Reset: *style = (struct Style) { .bg = -1, .fg = -1 };
+
+			break; case SetBold:      style->attr |= Bold; style->attr &= ~Dim;
+			break; case SetDim:       style->attr |= Dim; style->attr &= ~Bold;
+			break; case SetItalic:    style->attr |= Italic;
+			break; case SetUnderline: style->attr |= Underline;
+			break; case SetBlink:     style->attr |= Blink;
+			break; case SetReverse:   style->attr |= Reverse;
+
+			break; case UnsetBoldDim:   style->attr &= ~(Bold | Dim);
+			break; case UnsetItalic:    style->attr &= ~Italic;
+			break; case UnsetUnderline: style->attr &= ~Underline;
+			break; case UnsetBlink:     style->attr &= ~Blink;
+			break; case UnsetReverse:   style->attr &= ~Reverse;
+
+			break; case SetFg: {
+				if (++i < n && t->param.s[i] == Color256) {
+					if (++i < n) style->fg = t->param.s[i];
+				}
+			}
+			break; case SetBg: {
+				if (++i < n && t->param.s[i] == Color256) {
+					if (++i < n) style->bg = t->param.s[i];
+				}
+			}
+
+			break; case ResetFg: style->fg = -1;
+			break; case ResetBg: style->bg = -1;
+
+			break; default: {
+				uint p = t->param.s[i];
+				if (p >= SetFg0 && p <= SetFg7) {
+					style->fg = p - SetFg0;
+				} else if (p >= SetBg0 && p <= SetBg7) {
+					style->bg = p - SetBg0;
+				} else if (p >= SetFg8 && p <= SetFgF) {
+					style->fg = 8 + p - SetFg8;
+				} else if (p >= SetBg8 && p <= SetBgF) {
+					style->bg = 8 + p - SetBg8;
+				} else {
+					unhandled("unhandled SGR %u", p);
+				}
+			}
+		}
+	}
+}
+
+static void usascii(wchar_t _ch) { t->charset = USASCII; }
+static void decSpecial(wchar_t _ch) { t->charset = DECSpecial; }
+
+static const wchar_t AltCharset[128] = {
+	['`'] = L'◆', ['a'] = L'▒', ['f'] = L'°', ['g'] = L'±', ['i'] = L'␋',
+	['j'] = L'┘', ['k'] = L'┐', ['l'] = L'┌', ['m'] = L'└', ['n'] = L'┼',
+	['o'] = L'⎺', ['p'] = L'⎻', ['q'] = L'─', ['r'] = L'⎼', ['s'] = L'⎽',
+	['t'] = L'├', ['u'] = L'┤', ['v'] = L'┴', ['w'] = L'┬', ['x'] = L'│',
+	['y'] = L'≤', ['z'] = L'≥', ['{'] = L'π', ['|'] = L'≠', ['}'] = L'£',
+	['~'] = L'·',
+};
+
+static void add(wchar_t ch) {
+	if (t->charset == DECSpecial && ch < 128 && AltCharset[ch]) {
+		ch = AltCharset[ch];
+	}
+
+	int width = wcwidth(ch);
+	if (width < 0) {
+		unhandled("unhandled \\u%02X", ch);
+		return;
+	}
+
+	if (t->mode & Insert) {
+		uint n = min(width, t->cols - t->x);
+		move(cell(t->y, t->x + n), cell(t->y, t->x), t->cols - t->x - n);
+	}
+	if (t->mode & Wrap && t->x + width > t->cols) {
+		cr(0);
+		nl(0);
+	}
+	if (t->x == t->cols) t->x--;
+
+	cell(t->y, t->x)->style = t->style;
+	cell(t->y, t->x)->ch = ch;
+	for (int i = 1; i < width && t->x + i < t->cols; ++i) {
+		cell(t->y, t->x + i)->style = t->style;
+		cell(t->y, t->x + i)->ch = L'\0';
+	}
+	t->x = min(t->x + width, (t->mode & Wrap ? t->cols : t->cols - 1));
+}
+
+static void mc(wchar_t _ch) {
+	if (p(0, 0) == 10) {
+		t->mediaCopy = true;
+	} else {
+		unhandled("unhandled CSI %u MC", p(0, 0));
+	}
+}
+
+static void escDefault(wchar_t ch) {
+	unhandled("unhandled ESC %lc", ch);
+}
+
+static void g0Default(wchar_t ch) {
+	unhandled("unhandled G0 %lc", ch);
+	t->charset = USASCII;
+}
+
+static void csiInter(wchar_t ch) {
+	switch (t->state) {
+		break; case CSI: unhandled("unhandled CSI %lc ...", ch);
+		break; case CSILt: unhandled("unhandled CSI < %lc ...", ch);
+		break; case CSIEq: unhandled("unhandled CSI = %lc ...", ch);
+		break; case CSIGt: unhandled("unhandled CSI > %lc ...", ch);
+		break; case CSIQm: unhandled("unhandled CSI ? %lc ...", ch);
+		break; default: abort();
+	}
+}
+
+static void csiFinal(wchar_t ch) {
+	switch (t->state) {
+		break; case CSI: unhandled("unhandled CSI %lc", ch);
+		break; case CSILt: unhandled("unhandled CSI < %lc", ch);
+		break; case CSIEq: unhandled("unhandled CSI = %lc", ch);
+		break; case CSIGt: unhandled("unhandled CSI > %lc", ch);
+		break; case CSIQm: unhandled("unhandled CSI ? %lc", ch);
+		break; case CSIInter: unhandled("unhandled CSI ... %lc", ch);
+		break; default: abort();
+	}
+}
+
+#define S(s) break; case s: switch (ch)
+#define A(c, a, s) break; case c: a(ch); t->state = s
+#define D(a, s) break; default: a(ch); t->state = s
+static void update(wchar_t ch) {
+	switch (t->state) {
+		default: abort();
+
+		S(Data) {
+			A(BEL, nop, Data);
+			A(BS,  bs,  Data);
+			A(HT,  ht,  Data);
+			A(NL,  nl,  Data);
+			A(CR,  cr,  Data);
+			A(ESC, nop, Esc);
+			D(add, Data);
+		}
+
+		S(Esc) {
+			A('(', nop, G0);
+			A('7', decsc, Data);
+			A('8', decrc, Data);
+			A('=', deckpam, Data);
+			A('>', deckpnm, Data);
+			A('M', ri,  Data);
+			A('[', csi, CSI);
+			A(']', nop, OSC);
+			D(escDefault, Data);
+		}
+		S(G0) {
+			A('0', decSpecial, Data);
+			A('B', usascii, Data);
+			D(g0Default, Data);
+		}
+
+		S(CSI) {
+			A(' ' ... '/', csiInter, CSIInter);
+			A('0' ... '9', csiDigit, CSI);
+			A(':', nop, CSI);
+			A(';', csiSep, CSI);
+			A('<', nop, CSILt);
+			A('=', nop, CSIEq);
+			A('>', nop, CSIGt);
+			A('?', nop, CSIQm);
+			A('@', ich, Data);
+			A('A', cuu, Data);
+			A('B', cud, Data);
+			A('C', cuf, Data);
+			A('D', cub, Data);
+			A('E', cnl, Data);
+			A('F', cpl, Data);
+			A('G', cha, Data);
+			A('H', cup, Data);
+			A('J', ed,  Data);
+			A('K', el,  Data);
+			A('L', il,  Data);
+			A('M', dl,  Data);
+			A('P', dch, Data);
+			A('S', su,  Data);
+			A('T', sd,  Data);
+			A('X', ech, Data);
+			A('d', vpa, Data);
+			A('h', sm,  Data);
+			A('i', mc,  Data);
+			A('l', rm,  Data);
+			A('m', sgr, Data);
+			A('r', decstbm, Data);
+			A('t', nop, Data);
+			D(csiFinal, Data);
+		}
+
+		S(CSILt ... CSIGt) {
+			A(' ' ... '/', csiInter, CSIInter);
+			A('0' ... '9', csiDigit, t->state);
+			A(':', nop, t->state);
+			A(';', csiSep, t->state);
+			D(csiFinal, Data);
+		}
+
+		S(CSIQm) {
+			A(' ' ... '/', csiInter, CSIInter);
+			A('0' ... '9', csiDigit, CSIQm);
+			A(':', nop, CSIQm);
+			A(';', csiSep, CSIQm);
+			A('h', decset, Data);
+			A('l', decrst, Data);
+			D(csiFinal, Data);
+		}
+
+		S(CSIInter) {
+			D(csiFinal, Data);
+		}
+
+		S(OSC) {
+			A(BEL, nop, Data);
+			A(ESC, nop, OSCEsc);
+			D(nop, OSC);
+		}
+		S(OSCEsc) {
+			A('\\', nop, Data);
+			D(nop, OSC);
+		}
+	}
+}
+
+bool termUpdate(struct Term *term, wchar_t ch) {
+	t = term;
+	t->mediaCopy = false;
+	update(ch);
+	return t->mediaCopy;
+}
+
+bool termGround(const struct Term *term) {
+	return term->state == Data;
+}
+
+void termWrite(struct Term *term, const char *buf, size_t len) {
+	t = term;
+	while (len) {
+		wchar_t ch;
+		size_t n = mbrtowc(&ch, buf, len, &t->mbs);
+		if (n == (size_t)-2) break;
+		if (n == (size_t)-1) {
+			memset(&t->mbs, 0, sizeof(t->mbs));
+			ch = (unsigned char)*buf;
+			n = 1;
+		}
+		if (!n) n = 1;
+		update(ch);
+		buf += n;
+		len -= n;
+	}
+}
+
+struct Term *termAlloc(uint rows, uint cols, bool warn) {
+	t = calloc(1, sizeof(*t));
+	if (!t) err(EX_OSERR, "calloc");
+	t->rows = rows;
+	t->cols = cols;
+	t->style = (struct Style) { .bg = -1, .fg = -1 };
+	t->scroll.bot = rows;
+	t->mode = Wrap | Cursor;
+	t->warn = warn;
+	t->cells = calloc(rows * cols, sizeof(*t->cells));
+	if (!t->cells) err(EX_OSERR, "calloc");
+	erase(cell(0, 0), cell(rows - 1, cols));
+	return t;
+}
+
+void termFree(struct Term *term) {
+	free(term->cells);
+	free(term);
+}
+
+void termResize(struct Term *term, uint rows, uint cols) {
+	if (rows == term->rows && cols == term->cols) return;
+	t = term;
+	struct Cell *prev = t->cells;
+	uint prevCols = t->cols;
+	uint keep = min(rows, t->rows);
+	// Keep the bottom of the screen, where the cursor usually is:
+	uint skip = (t->y >= rows ? t->y + 1 - rows : 0);
+	if (skip > t->rows - keep) skip = t->rows - keep;
+	t->cells = calloc(rows * cols, sizeof(*t->cells));
+	if (!t->cells) err(EX_OSERR, "calloc");
+	t->rows = rows;
+	t->cols = cols;
+	struct Style style = t->style;
+	t->style = (struct Style) { .bg = -1, .fg = -1 };
+	erase(cell(0, 0), cell(rows - 1, cols));
+	t->style = style;
+	for (uint y = 0; y < keep; ++y) {
+		move(cell(y, 0), &prev[(skip + y) * prevCols], min(cols, prevCols));
+	}
+	free(prev);
+	t->y = min(t->y - skip, rows - 1);
+	t->x = min(t->x, cols - 1);
+	t->save.y = min(t->save.y, rows - 1);
+	t->save.x = min(t->save.x, cols - 1);
+	t->scroll.top = 0;
+	t->scroll.bot = rows;
+}
+
+static void span(
+	FILE *file, const struct TermHTML *opts,
+	const struct Style *prev, const struct Cell *cell
+) {
+	struct Style style = cell->style;
+	if (!prev || memcmp(prev, &style, sizeof(*prev))) {
+		if (prev) fprintf(file, "</span>");
+		if (style.bg < 0) style.bg = opts->bg;
+		if (style.fg < 0) style.fg = opts->fg;
+		if (opts->bright && style.attr & Bold) {
+			if (style.fg < 8) style.fg += 8;
+			style.attr ^= Bold;
+		}
+		fprintf(
+			file, "<span style=\"%s%s%s\" class=\"bg%u fg%u\">",
+			(style.attr & Bold ? "font-weight:bold;" : ""),
+			(style.attr & Italic ? "font-style:italic;" : ""),
+			(style.attr & Underline ? "text-decoration:underline;" : ""),
+			(style.attr & Reverse ? style.fg : style.bg),
+			(style.attr & Reverse ? style.bg : style.fg)
+		);
+	}
+	switch (cell->ch) {
+		break; case '&': fprintf(file, "&amp;");
+		break; case '<': fprintf(file, "&lt;");
+		break; case '>': fprintf(file, "&gt;");
+		break; default:  fprintf(file, "%lc", (wint_t)cell->ch);
+	}
+}
+
+void termHTML(FILE *file, struct Term *term, const struct TermHTML *opts) {
+	t = term;
+	bool cursor = (t->mode & Cursor) && !opts->hide;
+	struct Cell *at = cell(t->y, t->x);
+	if (at == cell(t->rows - 1, t->cols)) at--;
+	if (cursor) at->style.attr ^= Reverse;
+	fprintf(
+		file, "<pre style=\"width: %uch;\" class=\"bg%u fg%u\">",
+		t->cols, opts->bg, opts->fg
+	);
+	for (uint y = 0; y < t->rows; ++y) {
+		for (uint x = 0; x < t->cols; ++x) {
+			if (!cell(y, x)->ch) continue;
+			span(file, opts, (x ? &cell(y, x - 1)->style : NULL), cell(y, x));
+		}
+		fprintf(file, "</span>\n");
+	}
+	fprintf(file, "</pre>\n");
+	if (cursor) at->style.attr ^= Reverse;
+}
+
+static void drawStyle(FILE *file, struct Style style) {
+	fprintf(file, "\33[0");
+	if (style.attr & Bold) fprintf(file, ";%u", SetBold);
+	if (style.attr & Dim) fprintf(file, ";%u", SetDim);
+	if (style.attr & Italic) fprintf(file, ";%u", SetItalic);
+	if (style.attr & Underline) fprintf(file, ";%u", SetUnderline);
+	if (style.attr & Blink) fprintf(file, ";%u", SetBlink);
+	if (style.attr & Reverse) fprintf(file, ";%u", SetReverse);
+	if (style.fg >= 0 && style.fg < 8) fprintf(file, ";%d", SetFg0 + style.fg);
+	if (style.bg >= 0 && style.bg < 8) fprintf(file, ";%d", SetBg0 + style.bg);
+	if (style.fg >= 8 && style.fg < 16) {
+		fprintf(file, ";%d", SetFg8 + style.fg - 8);
+	}
+	if (style.bg >= 8 && style.bg < 16) {
+		fprintf(file, ";%d", SetBg8 + style.bg - 8);
+	}
+	if (style.fg >= 16) fprintf(file, ";%u;%u;%d", SetFg, Color256, style.fg);
+	if (style.bg >= 16) fprintf(file, ";%u;%u;%d", SetBg, Color256, style.bg);
+	fprintf(file, "m");
+}
+
+static bool blank(const struct Cell *cell) {
+	return cell->ch == L' ' && !cell->style.attr
+		&& cell->style.bg < 0 && cell->style.fg < 0;
+}
+
+static void drawCell(FILE *file, mbstate_t *mbs, const struct Cell *cell) {
+	char mb[MB_LEN_MAX];
+	size_t n = wcrtomb(mb, cell->ch, mbs);
+	if (n == (size_t)-1) {
+		memset(mbs, 0, sizeof(*mbs));
+		mb[0] = '?';
+		n = 1;
+	}
+	fwrite(mb, n, 1, file);
+}
+
+void termDraw(FILE *file, const struct Term *term) {
+	mbstate_t mbs = {0};
+	struct Style none = { .bg = -1, .fg = -1 };
+	const struct Style *prev = &none;
+	// The screen is only kept once, so draw it on the alternate screen if
+	// that is where it is.
+	if (term->mode & AltScreen) fprintf(file, "\33[?1049h");
+	fprintf(file, "\33[r\33[0m\33[H\33[2J");
+	for (uint y = 0; y < term->rows; ++y) {
+		const struct Cell *row = &term->cells[y * term->cols];
+		uint end = term->cols;
+		while (end && blank(&row[end - 1])) end--;
+		if (!end) continue;
+		fprintf(file, "\33[%u;1H", 1 + y);
+		for (uint x = 0; x < end; ++x) {
+			if (!row[x].ch) continue;
+			if (memcmp(prev, &row[x].style, sizeof(*prev))) {
+				prev = &row[x].style;
+				drawStyle(file, *prev);
+			}
+			drawCell(file, &mbs, &row[x]);
+		}
+	}
+	if (term->scroll.top || term->scroll.bot != term->rows) {
+		fprintf(file, "\33[%u;%ur", 1 + term->scroll.top, term->scroll.bot);
+	}
+	fprintf(file, "\33[%u;%uH\33" "7", 1 + term->save.y, 1 + term->save.x);
+	if (term->x < term->cols) {
+		fprintf(file, "\33[%u;%uH", 1 + term->y, 1 + term->x);
+	} else {
+		// Rewrite the last character of the line to leave a pending wrap:
+		const struct Cell *row = &term->cells[term->y * term->cols];
+		uint x = term->cols - 1;
+		while (x && !row[x].ch) x--;
+		fprintf(file, "\33[%u;%uH", 1 + term->y, 1 + x);
+		drawStyle(file, row[x].style);
+		drawCell(file, &mbs, &row[x]);
+	}
+	drawStyle(file, term->style);
+	if (term->mode & Insert) fprintf(file, "\33[4h");
+	if (!(term->mode & Wrap)) fprintf(file, "\33[?7l");
+	if (!(term->mode & Cursor)) fprintf(file, "\33[?25l");
+	if (term->mode & AppCursor) fprintf(file, "\33[?1h");
+	if (term->mode & AppKeypad) fprintf(file, "\33=");
+	if (term->mode & MouseClick) fprintf(file, "\33[?1000h");
+	if (term->mode & MouseDrag) fprintf(file, "\33[?1002h");
+	if (term->mode & MouseMove) fprintf(file, "\33[?1003h");
+	if (term->mode & MouseSGR) fprintf(file, "\33[?1006h");
+	if (term->mode & Paste) fprintf(file, "\33[?2004h");
+	if (term->charset == DECSpecial) fprintf(file, "\33(0");
+}
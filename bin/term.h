@@ -0,0 +1,51 @@
+/* Copyright (C) 2019  C. McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <wchar.h>
+
+// Terminal emulation for TERM=xterm as used by ncurses.
+struct Term;
+
+// Allocate a terminal, which warns of unhandled sequences if warn is set.
+struct Term *termAlloc(unsigned rows, unsigned cols, bool warn);
+void termFree(struct Term *term);
+void termResize(struct Term *term, unsigned rows, unsigned cols);
+
+// Update the terminal with a character. Returns true for a media copy
+// request (CSI 10 i).
+bool termUpdate(struct Term *term, wchar_t ch);
+
+// Whether the terminal is between control sequences.
+bool termGround(const struct Term *term);
+
+// Update the terminal with output decoded in the current locale.
+void termWrite(struct Term *term, const char *buf, size_t len);
+
+struct TermHTML {
+	bool bright;
+	bool hide;
+	int bg, fg;
+};
+
+// Write the terminal screen as HTML <pre>.
+void termHTML(FILE *file, struct Term *term, const struct TermHTML *opts);
+
+// Write control sequences which reproduce the terminal screen and state on a
+// reset terminal of the same size.
+void termDraw(FILE *file, const struct Term *term);
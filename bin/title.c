@@ -14,6 +14,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <ctype.h>
 #include <curl/curl.h>
 #include <err.h>
 #include <locale.h>
@@ -82,68 +83,231 @@ static void showTitle(const char *title) {
 }
 
 static CURL *curl;
-static bool title;
-static struct {
-	char buf[64 * 1024];
-	size_t len;
-} body;
+static CURLM *multi;
+
+// URLs are fetched concurrently as jobs in a list kept in input order.
+static struct Job {
+	struct Job *next;
+	char *url;
+	CURL *curl;
+	bool done;
+	bool stop;
+	char *title;
+	struct Scan {
+		enum { Open, Text, Close } state;
+		size_t match;
+		size_t seen;
+		char *buf;
+		size_t len, cap;
+	} scan;
+	char error[CURL_ERROR_SIZE];
+} *jobs, **jobsTail = &jobs, *jobsNext;
+static size_t running;
 
 // HE COMES
-static const char TitlePattern[] = "<title>([^<]*)</title>";
-static regex_t TitleRegex;
+// Scan for <title>([^<]*)</title> without case, a byte at a time so that the
+// state carries over between chunks of the body.
+static const char TitleOpen[] = "<title>";
+static const char TitleClose[] = "</title>";
+enum { TitleLimit = 64 * 1024 };
+
+static void scanPush(struct Scan *scan, char ch) {
+	if (scan->len == scan->cap) {
+		scan->cap = (scan->cap ? scan->cap * 2 : 256);
+		scan->buf = realloc(scan->buf, scan->cap);
+		if (!scan->buf) err(EX_OSERR, "realloc");
+	}
+	scan->buf[scan->len++] = ch;
+}
+
+// Returns true once the closing tag is seen, with the title in scan->buf.
+static bool scanTitle(struct Scan *scan, const char *ptr, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		char ch = tolower((unsigned char)ptr[i]);
+		switch (scan->state) {
+			break; case Open: {
+				if (ch != TitleOpen[scan->match]) {
+					scan->match = (ch == '<');
+				} else if (!TitleOpen[++scan->match]) {
+					scan->state = Text;
+					scan->len = 0;
+				}
+			}
+			break; case Text: {
+				if (ch == '<') {
+					scan->state = Close;
+					scan->match = 1;
+				} else {
+					scanPush(scan, ptr[i]);
+				}
+			}
+			break; case Close: {
+				if (ch != TitleClose[scan->match]) {
+					// Look at this byte again as part of an opening tag,
+					// after the '<' if that was all that matched.
+					scan->state = Open;
+					scan->match = (scan->match == 1);
+					i--;
+				} else if (!TitleClose[++scan->match]) {
+					scanPush(scan, '\0');
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+}
 
 static size_t handleBody(char *buf, size_t size, size_t nitems, void *user) {
-	(void)user;
+	struct Job *job = user;
 	size_t len = size * nitems;
-	size_t cap = sizeof(body.buf) - body.len - 1;
-	size_t new = (len < cap ? len : cap);
-	if (title || !new) return len;
 
-	memcpy(&body.buf[body.len], buf, new);
-	body.len += new;
-	body.buf[body.len] = '\0';
-
-	regmatch_t match[2];
-	if (regexec(&TitleRegex, body.buf, 2, match, 0)) return len;
-	body.buf[match[1].rm_eo] = '\0';
-	showTitle(&body.buf[match[1].rm_so]);
-	title = true;
+	// Only HTML is of interest, so stop other transfers without reading them.
+	if (!job->scan.seen) {
+		char *type;
+		curl_easy_getinfo(job->curl, CURLINFO_CONTENT_TYPE, &type);
+		if (!type || strncmp(type, "text/html", 9)) {
+			job->stop = true;
+			return 0;
+		}
+	}
 
+	// Stop the transfer once the title is found, or if it isn't near the top.
+	size_t cap = TitleLimit - job->scan.seen;
+	if (scanTitle(&job->scan, buf, (len < cap ? len : cap))) {
+		job->title = job->scan.buf;
+		job->scan.buf = NULL;
+		job->stop = true;
+		return 0;
+	}
+	job->scan.seen += len;
+	if (job->scan.seen >= TitleLimit) {
+		job->stop = true;
+		return 0;
+	}
 	return len;
 }
 
-static CURLcode fetchTitle(const char *url) {
-	CURLcode code = curl_easy_setopt(curl, CURLOPT_URL, url);
-	if (code) return code;
-
-	curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-	code = curl_easy_perform(curl);
-	if (code) return code;
-
-	char *type;
-	code = curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &type);
-	if (code) return code;
-	if (!type || strncmp(type, "text/html", 9)) return CURLE_OK;
-
-	char *dest;
-	curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &dest);
-	dest = strdup(dest);
-	if (!dest) err(EX_OSERR, "strdup");
-
-	code = curl_easy_setopt(curl, CURLOPT_URL, dest);
-	if (code) return code;
-	free(dest);
-
-	body.len = 0;
-	title = false;
-	curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
-	code = curl_easy_perform(curl);
-	return code;
+static void jobPush(const char *url) {
+	struct Job *job = calloc(1, sizeof(*job));
+	if (!job) err(EX_OSERR, "calloc");
+	job->url = strdup(url);
+	if (!job->url) err(EX_OSERR, "strdup");
+	*jobsTail = job;
+	jobsTail = &job->next;
+	if (!jobsNext) jobsNext = job;
+}
+
+static void jobStart(struct Job *job) {
+	job->curl = curl_easy_duphandle(curl);
+	if (!job->curl) errx(EX_SOFTWARE, "curl_easy_duphandle");
+	curl_easy_setopt(job->curl, CURLOPT_URL, job->url);
+	curl_easy_setopt(job->curl, CURLOPT_ERRORBUFFER, job->error);
+	curl_easy_setopt(job->curl, CURLOPT_WRITEDATA, job);
+	curl_easy_setopt(job->curl, CURLOPT_PRIVATE, job);
+	CURLMcode code = curl_multi_add_handle(multi, job->curl);
+	if (code) {
+		errx(
+			EX_SOFTWARE, "curl_multi_add_handle: %s",
+			curl_multi_strerror(code)
+		);
+	}
+	running++;
+}
+
+static bool jobFinish(struct Job *job, CURLcode code) {
+	curl_multi_remove_handle(multi, job->curl);
+	curl_easy_cleanup(job->curl);
+	job->curl = NULL;
+	free(job->scan.buf);
+	job->scan.buf = NULL;
+	job->done = true;
+	running--;
+	if (code == CURLE_WRITE_ERROR && job->stop) code = CURLE_OK;
+	if (code) warnx("%s: %s", job->url, job->error);
+	return !code;
+}
+
+static void jobFree(struct Job *job) {
+	if (job->title) showTitle(job->title);
+	free(job->title);
+	free(job->url);
+	free(job);
+}
+
+static size_t jobsLimit = 4;
+static bool unordered;
+
+// Start waiting jobs, transfer, and output finished jobs. Returns false if
+// any job failed.
+static bool jobsRun(void) {
+	bool ok = true;
+	// Refill slots as soon as jobs finish, since with none left running the
+	// caller would poll for the whole timeout before starting any more.
+	for (bool refill = true; refill;) {
+		while (jobsNext && running < jobsLimit) {
+			jobStart(jobsNext);
+			jobsNext = jobsNext->next;
+		}
+
+		int still;
+		CURLMcode code = curl_multi_perform(multi, &still);
+		if (code) {
+			errx(
+				EX_SOFTWARE, "curl_multi_perform: %s",
+				curl_multi_strerror(code)
+			);
+		}
+
+		refill = false;
+		CURLMsg *msg;
+		while (NULL != (msg = curl_multi_info_read(multi, &still))) {
+			if (msg->msg != CURLMSG_DONE) continue;
+			struct Job *job;
+			curl_easy_getinfo(
+				msg->easy_handle, CURLINFO_PRIVATE, (char **)&job
+			);
+			if (!jobFinish(job, msg->data.result)) ok = false;
+			if (jobsNext) refill = true;
+		}
+	}
+
+	for (struct Job **ptr = &jobs; *ptr;) {
+		struct Job *job = *ptr;
+		if (!job->done) {
+			if (!unordered) break;
+			ptr = &job->next;
+			continue;
+		}
+		*ptr = job->next;
+		if (jobsTail == &job->next) jobsTail = ptr;
+		jobFree(job);
+	}
+	return ok;
+}
+
+static regex_t urlRegex;
+static bool exclude;
+static regex_t excludeRegex;
+
+static void scan(char *line) {
+	regmatch_t match = {0};
+	for (char *ptr = line; *ptr; ptr += match.rm_eo) {
+		if (regexec(&urlRegex, ptr, 1, &match, 0)) break;
+		char end = ptr[match.rm_eo];
+		ptr[match.rm_eo] = '\0';
+		const char *url = &ptr[match.rm_so];
+		if (!exclude || regexec(&excludeRegex, url, 0, NULL, 0)) {
+			jobPush(url);
+		}
+		ptr[match.rm_eo] = end;
+		if (!end) break;
+	}
 }
 
 int main(int argc, char *argv[]) {
 	EntityRegex = regex(EntityPattern, 0);
-	TitleRegex = regex(TitlePattern, REG_ICASE);
+	urlRegex = regex("https?://([^[:space:]>\"()]|[(][^)]*[)])+", 0);
 
 	setlocale(LC_CTYPE, "");
 	setlinebuf(stdout);
@@ -154,9 +318,6 @@ int main(int argc, char *argv[]) {
 	curl = curl_easy_init();
 	if (!curl) errx(EX_SOFTWARE, "curl_easy_init");
 
-	static char error[CURL_ERROR_SIZE];
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error);
-
 	curl_easy_setopt(curl, CURLOPT_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
 	curl_easy_setopt(
 		curl, CURLOPT_USERAGENT,
@@ -169,43 +330,75 @@ int main(int argc, char *argv[]) {
 
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, handleBody);
 
-	bool exclude = false;
-	regex_t excludeRegex;
-
 	int opt;
-	while (0 < (opt = getopt(argc, argv, "x:v"))) {
+	while (0 < (opt = getopt(argc, argv, "j:uvx:"))) {
 		switch (opt) {
+			break; case 'j': jobsLimit = strtoul(optarg, NULL, 10);
+			break; case 'u': unordered = true;
+			break; case 'v': curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 			break; case 'x': {
 				exclude = true;
 				excludeRegex = regex(optarg, REG_NOSUB);
 			}
-			break; case 'v': curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 			break; default:  return EX_USAGE;
 		}
 	}
+	if (!jobsLimit) errx(EX_USAGE, "jobs must be positive");
+
+	multi = curl_multi_init();
+	if (!multi) errx(EX_SOFTWARE, "curl_multi_init");
+	// Connections are kept in the multi handle for later URLs to reuse.
+	curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)jobsLimit);
 
 	if (optind < argc) {
-		code = fetchTitle(argv[optind]);
-		if (!code) return EX_OK;
-		errx(EX_DATAERR, "curl_easy_perform: %s", error);
+		jobPush(argv[optind]);
+		bool ok = true;
+		while (jobs) {
+			if (!jobsRun()) ok = false;
+			if (jobs) curl_multi_poll(multi, NULL, 0, 1000, NULL);
+		}
+		return (ok ? EX_OK : EX_DATAERR);
 	}
 
 	char *buf = NULL;
-	size_t cap = 0;
-
-	regex_t urlRegex = regex("https?://([^[:space:]>\"()]|[(][^)]*[)])+", 0);
-	while (0 < getline(&buf, &cap, stdin)) {
-		regmatch_t match = {0};
-		for (char *ptr = buf; *ptr; ptr += match.rm_eo) {
-			if (regexec(&urlRegex, ptr, 1, &match, 0)) break;
-			ptr[match.rm_eo] = '\0';
-			const char *url = &ptr[match.rm_so];
-			if (!exclude || regexec(&excludeRegex, url, 0, NULL, 0)) {
-				code = fetchTitle(url);
-				if (code) warnx("curl_easy_perform: %s", error);
-			}
-			ptr[match.rm_eo] = ' ';
+	size_t len = 0, cap = 0;
+	bool eof = false;
+	for (;;) {
+		jobsRun();
+		if (eof && !jobs) break;
+		struct curl_waitfd wait = {
+			.fd = STDIN_FILENO,
+			.events = CURL_WAIT_POLLIN,
+		};
+		CURLMcode code = curl_multi_poll(
+			multi, (eof ? NULL : &wait), !eof, 1000, NULL
+		);
+		if (code) {
+			errx(
+				EX_SOFTWARE, "curl_multi_poll: %s", curl_multi_strerror(code)
+			);
+		}
+		if (eof || !wait.revents) continue;
+
+		if (cap - len < 2) {
+			cap = (cap ? cap * 2 : 4096);
+			buf = realloc(buf, cap);
+			if (!buf) err(EX_OSERR, "realloc");
+		}
+		ssize_t size = read(STDIN_FILENO, &buf[len], cap - len - 1);
+		if (size < 0) err(EX_IOERR, "read");
+		if (!size) eof = true;
+		len += size;
+		if (eof && len) buf[len++] = '\n';
+
+		char *nl;
+		char *line = buf;
+		while (NULL != (nl = memchr(line, '\n', &buf[len] - line))) {
+			*nl = '\0';
+			scan(line);
+			line = &nl[1];
 		}
+		len -= line - buf;
+		memmove(buf, line, len);
 	}
-	if (ferror(stdin)) err(EX_IOERR, "getline");
 }
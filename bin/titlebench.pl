@@ -0,0 +1,84 @@
+#!/usr/bin/env perl
+use strict;
+use warnings;
+use IO::Socket::INET;
+use IPC::Open2 qw(open2);
+use POSIX qw(ceil fmod);
+use Time::HiRes qw(sleep time);
+
+# Time title fetching pages from a local server which answers after a delay:
+# titlebench.pl [-d delay] [-n urls] [-p port] title [jobs ...]
+# Each batch of jobs should take about the delay, and at most half a second
+# more, which a poll timeout between batches would exceed.
+my %opts;
+while (@ARGV && $ARGV[0] =~ /^-([dnp])$/) {
+	shift;
+	$opts{$1} = shift;
+}
+my ($title, @jobs) = @ARGV;
+die "usage: $0 [-d delay] [-n urls] [-p port] title [jobs ...]\n"
+	unless $title;
+@jobs = qw(1 2 4 8) unless @jobs;
+my $delay = $opts{d} // 0.05;
+my $urls = $opts{n} // 10;
+my $port = $opts{p} // 8080;
+
+my $listen = IO::Socket::INET->new(
+	LocalAddr => '127.0.0.1', LocalPort => $port, Listen => 16, ReuseAddr => 1,
+) or die "listen: $!\n";
+$SIG{CHLD} = 'IGNORE';
+my $server = fork // die "fork: $!\n";
+if (!$server) {
+	while (my $conn = $listen->accept) {
+		next if fork;
+		my $path = '';
+		while (my $line = <$conn>) {
+			$path = $1 if $line =~ m{^GET /(\S*)};
+			last if $line =~ /^\r?\n$/;
+		}
+		# Answer on a common tick, so that a batch of jobs ends together.
+		sleep $delay - fmod(time, $delay);
+		my $body = "<html><head><title>Page $path</title></head></html>\n";
+		print $conn join "\r\n",
+			'HTTP/1.1 200 OK',
+			'Content-Type: text/html',
+			'Content-Length: ' . length $body,
+			'Connection: close',
+			'', $body;
+		exit;
+	}
+	exit;
+}
+close $listen;
+$SIG{CHLD} = 'DEFAULT';
+END { kill 'TERM', $server if $server }
+
+# Returns the seconds title takes to output every title in order.
+sub run {
+	my ($jobs) = @_;
+	my $start = time;
+	my $pid = open2(my $out, my $in, $title, '-j', $jobs);
+	print $in "http://127.0.0.1:$port/$_\n" for 1 .. $urls;
+	close $in;
+	my @got = <$out>;
+	waitpid $pid, 0;
+	die "$title -j $jobs failed\n" if $?;
+	chomp @got;
+	my @want = map { "Page $_" } 1 .. $urls;
+	die "$title -j $jobs output @got\n" if "@got" ne "@want";
+	return time - $start;
+}
+
+my $slow = 0;
+printf "%-8s %8s %8s\n", qw(jobs expected wall);
+for my $jobs (@jobs) {
+	my $expected = ceil($urls / $jobs) * $delay;
+	my $wall = run($jobs);
+	printf "%-8d %8.2f %8.2f", $jobs, $expected, $wall;
+	if ($wall > $expected + 0.5) {
+		print ' SLOW';
+		$slow++;
+	}
+	print "\n";
+}
+exit ($slow ? 1 : 0);
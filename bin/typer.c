@@ -26,42 +26,113 @@
  */
 
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sysexits.h>
 #include <tls.h>
 #include <unistd.h>
 
 static bool verbose;
-static struct tls *client;
 static const char *join;
 static bool reverse;
 
-static void clientWrite(const char *ptr, size_t len) {
-	if (verbose) printf("%.*s", (int)len, ptr);
-	while (len) {
-		ssize_t ret = tls_write(client, ptr, len);
-		if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) continue;
-		if (ret < 0) errx(EX_IOERR, "tls_write: %s", tls_error(client));
-		ptr += ret;
-		len -= ret;
+enum Forward {
+	Echo = 1 << 0,
+	Mirror = 1 << 1,
+};
+static enum Forward forward = Echo;
+
+static struct Conn {
+	const char *host;
+	struct tls *client;
+	int sock;
+	short readWant;
+	short writeWant;
+	struct {
+		char *ptr;
+		size_t len, cap;
+	} out;
+	char buf[4096];
+	size_t len;
+} *conns;
+static size_t connsLen;
+
+static short connWant(ssize_t ret) {
+	return (ret == TLS_WANT_POLLOUT ? POLLOUT : POLLIN);
+}
+
+static void connFlush(struct Conn *conn) {
+	size_t sent = 0;
+	while (sent < conn->out.len) {
+		ssize_t ret = tls_write(
+			conn->client, &conn->out.ptr[sent], conn->out.len - sent
+		);
+		if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) {
+			conn->writeWant = connWant(ret);
+			break;
+		}
+		if (ret < 0) {
+			errx(
+				EX_IOERR, "%s: tls_write: %s",
+				conn->host, tls_error(conn->client)
+			);
+		}
+		sent += ret;
 	}
+	conn->out.len -= sent;
+	memmove(conn->out.ptr, &conn->out.ptr[sent], conn->out.len);
+	if (!conn->out.len) conn->writeWant = 0;
 }
 
-static void format(const char *format, ...) {
+static void connWrite(struct Conn *conn, const char *ptr, size_t len) {
+	if (verbose) {
+		if (connsLen > 1) printf("%s ", conn->host);
+		printf("%.*s", (int)len, ptr);
+	}
+	if (conn->out.len + len > conn->out.cap) {
+		if (!conn->out.cap) conn->out.cap = 4096;
+		while (conn->out.len + len > conn->out.cap) conn->out.cap *= 2;
+		conn->out.ptr = realloc(conn->out.ptr, conn->out.cap);
+		if (!conn->out.ptr) err(EX_OSERR, "realloc");
+	}
+	memcpy(&conn->out.ptr[conn->out.len], ptr, len);
+	conn->out.len += len;
+	if (!conn->writeWant) connFlush(conn);
+}
+
+static void format(struct Conn *conn, const char *format, ...) {
 	char buf[1024];
 	va_list ap;
 	va_start(ap, format);
 	int len = vsnprintf(buf, sizeof(buf), format, ap);
 	va_end(ap);
 	if ((size_t)len > sizeof(buf) - 1) errx(EX_DATAERR, "message too large");
-	clientWrite(buf, len);
+	connWrite(conn, buf, len);
+}
+
+static void
+type(struct Conn *conn, const char *tags, const char *nick, const char *dest) {
+	if (!reverse) {
+		format(conn, "@%s TAGMSG %s\r\n", tags, dest);
+	} else if (strstr(tags, "typing=active")) {
+		format(conn, "PRIVMSG %s :\u2328\uFE0F %s is typing!\r\n", dest, nick);
+	} else if (strstr(tags, "typing=paused")) {
+		format(conn, "PRIVMSG %s :\U0001F914 %s is thinking!\r\n", dest, nick);
+	} else if (strstr(tags, "typing=done")) {
+		format(conn, "PRIVMSG %s :\u270B %s stopped typing!\r\n", dest, nick);
+	}
 }
 
-static void handle(char *line) {
+static void handle(struct Conn *conn, char *line) {
 	char *tags = NULL;
 	char *origin = NULL;
 	if (line && line[0] == '@') tags = 1 + strsep(&line, " ");
@@ -72,42 +143,121 @@ static void handle(char *line) {
 		char *param = strsep(&line, " ");
 		if (!param) errx(EX_PROTOCOL, "CAP missing parameter");
 		if (!strcmp(param, "NAK")) {
-			errx(EX_CONFIG, "server does not support %s", line);
+			errx(EX_CONFIG, "%s: server does not support %s", conn->host, line);
 		}
-		format("CAP END\r\n");
+		format(conn, "CAP END\r\n");
 	} else if (!strcmp(cmd, "001") && join) {
-		format("JOIN %s\r\n", join);
+		format(conn, "JOIN %s\r\n", join);
 	} else if (!strcmp(cmd, "PING")) {
-		format("PONG %s\r\n", line);
+		format(conn, "PONG %s\r\n", line);
 	}
 	if (strcmp(cmd, "TAGMSG") || !tags || !origin) return;
 	if (!strstr(tags, "typing=")) return;
 	char *nick = strsep(&origin, "!");
 	if (*line == ':') line++;
-	if (!reverse) {
-		format("@%s TAGMSG %s\r\n", tags, line);
-	} else if (strstr(tags, "typing=active")) {
-		format("PRIVMSG %s :\u2328\uFE0F %s is typing!\r\n", line, nick);
-	} else if (strstr(tags, "typing=paused")) {
-		format("PRIVMSG %s :\U0001F914 %s is thinking!\r\n", line, nick);
-	} else if (strstr(tags, "typing=done")) {
-		format("PRIVMSG %s :\u270B %s stopped typing!\r\n", line, nick);
+	if (forward & Echo) type(conn, tags, nick, line);
+	// Only channels have the same name on other networks.
+	if (!(forward & Mirror) || !strchr("#&", line[0])) return;
+	for (size_t i = 0; i < connsLen; ++i) {
+		if (&conns[i] != conn) type(&conns[i], tags, nick, line);
+	}
+}
+
+static void connRead(struct Conn *conn) {
+	conn->readWant = 0;
+	// TLS may hold decrypted data the socket does not show, so read until it
+	// wants more.
+	for (;;) {
+		ssize_t read = tls_read(
+			conn->client, &conn->buf[conn->len], sizeof(conn->buf) - conn->len
+		);
+		if (read == TLS_WANT_POLLIN || read == TLS_WANT_POLLOUT) {
+			if (read == TLS_WANT_POLLOUT) conn->readWant = POLLOUT;
+			break;
+		}
+		if (read < 0) {
+			errx(
+				EX_IOERR, "%s: tls_read: %s",
+				conn->host, tls_error(conn->client)
+			);
+		}
+		if (!read) errx(EX_UNAVAILABLE, "%s: server disconnected", conn->host);
+		conn->len += read;
+
+		char *crlf;
+		char *line = conn->buf;
+		for (;;) {
+			crlf = memmem(line, &conn->buf[conn->len] - line, "\r\n", 2);
+			if (!crlf) break;
+			crlf[0] = '\0';
+			if (verbose) {
+				if (connsLen > 1) printf("%s ", conn->host);
+				printf("%s\n", line);
+			}
+			handle(conn, line);
+			line = &crlf[2];
+		}
+		if (line == conn->buf && conn->len == sizeof(conn->buf)) {
+			errx(EX_PROTOCOL, "%s: line too long", conn->host);
+		}
+		conn->len -= line - conn->buf;
+		memmove(conn->buf, line, conn->len);
 	}
+	if (conn->out.len) connFlush(conn);
+}
+
+static int dial(const char *host, const char *port) {
+	struct addrinfo *head;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_protocol = IPPROTO_TCP,
+	};
+	int error = getaddrinfo(host, port, &hints, &head);
+	if (error) errx(EX_NOHOST, "%s: %s", host, gai_strerror(error));
+
+	int sock = -1;
+	for (struct addrinfo *ai = head; ai; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock < 0) err(EX_OSERR, "socket");
+
+		error = connect(sock, ai->ai_addr, ai->ai_addrlen);
+		if (!error) break;
+
+		close(sock);
+		sock = -1;
+	}
+	if (sock < 0) err(EX_UNAVAILABLE, "%s", host);
+	freeaddrinfo(head);
+
+	error = fcntl(sock, F_SETFL, O_NONBLOCK);
+	if (error) err(EX_OSERR, "fcntl");
+	return sock;
 }
 
 int main(int argc, char *argv[]) {
-	const char *host = NULL;
 	const char *port = "6697";
 	const char *cert = NULL;
 	const char *nick = "typer";
 	const char *user = "typer";
 	bool passive = false;
 
-	for (int opt; 0 < (opt = getopt(argc, argv, "PRc:j:n:p:u:v"));) {
+	for (int opt; 0 < (opt = getopt(argc, argv, "PRc:f:j:n:p:u:v"));) {
 		switch (opt) {
 			break; case 'P': passive = true;
 			break; case 'R': reverse = true;
 			break; case 'c': cert = optarg;
+			break; case 'f': {
+				if (!strcmp(optarg, "echo")) {
+					forward = Echo;
+				} else if (!strcmp(optarg, "mirror")) {
+					forward = Mirror;
+				} else if (!strcmp(optarg, "all")) {
+					forward = Echo | Mirror;
+				} else {
+					errx(EX_USAGE, "invalid forward mode: %s", optarg);
+				}
+			}
 			break; case 'j': join = optarg;
 			break; case 'n': nick = optarg;
 			break; case 'p': port = optarg;
@@ -117,10 +267,6 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	if (optind == argc) errx(EX_USAGE, "host required");
-	host = argv[optind];
-
-	client = tls_client();
-	if (!client) errx(EX_SOFTWARE, "tls_client");
 
 	struct tls_config *config = tls_config_new();
 	if (!config) errx(EX_SOFTWARE, "tls_config_new");
@@ -130,41 +276,60 @@ int main(int argc, char *argv[]) {
 		if (error) errx(EX_CONFIG, "%s: %s", cert, tls_config_error(config));
 	}
 
-	int error = tls_configure(client, config);
-	if (error) errx(EX_SOFTWARE, "tls_configure: %s", tls_error(client));
-	tls_config_free(config);
+	connsLen = argc - optind;
+	conns = calloc(connsLen, sizeof(*conns));
+	if (!conns) err(EX_OSERR, "calloc");
+	struct pollfd *fds = calloc(connsLen, sizeof(*fds));
+	if (!fds) err(EX_OSERR, "calloc");
 
-	error = tls_connect(client, host, port);
-	if (error) errx(EX_UNAVAILABLE, "tls_connect: %s", tls_error(client));
+	for (size_t i = 0; i < connsLen; ++i) {
+		struct Conn *conn = &conns[i];
+		conn->host = argv[optind + i];
+		// Allow host:port, but not to split an IPv6 address.
+		const char *connPort = port;
+		char *colon = strchr(argv[optind + i], ':');
+		if (colon && !strchr(&colon[1], ':')) {
+			*colon = '\0';
+			connPort = &colon[1];
+		}
+		conn->client = tls_client();
+		if (!conn->client) errx(EX_SOFTWARE, "tls_client");
 
-	format(
-		"CAP REQ :message-tags%s\r\n"
-		"NICK %s\r\n"
-		"USER %s 0 * :typer\r\n",
-		(passive ? " causal.agency/passive" : ""),
-		nick, user
-	);
+		int error = tls_configure(conn->client, config);
+		if (error) {
+			errx(EX_SOFTWARE, "tls_configure: %s", tls_error(conn->client));
+		}
 
-	size_t len = 0;
-	char buf[4096];
-	for (;;) {
-		ssize_t read = tls_read(client, &buf[len], sizeof(buf) - len);
-		if (read == TLS_WANT_POLLIN || read == TLS_WANT_POLLOUT) continue;
-		if (read < 0) errx(EX_IOERR, "tls_read: %s", tls_error(client));
-		if (!read) errx(EX_UNAVAILABLE, "server disconnected");
-		len += read;
+		conn->sock = dial(conn->host, connPort);
+		error = tls_connect_socket(conn->client, conn->sock, conn->host);
+		if (error) {
+			errx(
+				EX_UNAVAILABLE, "%s: tls_connect: %s",
+				conn->host, tls_error(conn->client)
+			);
+		}
+		fds[i].fd = conn->sock;
 
-		char *crlf;
-		char *line = buf;
-		for (;;) {
-			crlf = memmem(line, &buf[len] - line, "\r\n", 2);
-			if (!crlf) break;
-			crlf[0] = '\0';
-			if (verbose) printf("%s\n", line);
-			handle(line);
-			line = &crlf[2];
+		format(
+			conn,
+			"CAP REQ :message-tags%s\r\n"
+			"NICK %s\r\n"
+			"USER %s 0 * :typer\r\n",
+			(passive ? " causal.agency/passive" : ""),
+			nick, user
+		);
+	}
+	tls_config_free(config);
+
+	for (;;) {
+		for (size_t i = 0; i < connsLen; ++i) {
+			fds[i].events = POLLIN | conns[i].readWant | conns[i].writeWant;
+		}
+		int nfds = poll(fds, connsLen, -1);
+		if (nfds < 0 && errno == EINTR) continue;
+		if (nfds < 0) err(EX_IOERR, "poll");
+		for (size_t i = 0; i < connsLen; ++i) {
+			if (fds[i].revents) connRead(&conns[i]);
 		}
-		len -= line - buf;
-		memmove(buf, line, len);
 	}
 }
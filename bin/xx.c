@@ -16,9 +16,14 @@
 
 #include <ctype.h>
 #include <err.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <sysexits.h>
 #include <unistd.h>
 
@@ -40,84 +45,432 @@ static struct {
 	bool skip;
 } options = { 16, 8, 0, true, true, false };
 
-static void dump(FILE *file) {
-	bool skip = false;
+static const char Digits[] = "0123456789ABCDEF";
+static char Hex[256][3];
+static char ASCII[256];
 
-	byte buf[options.cols];
-	size_t offset = 0;
-	for (
-		size_t size;
-		(size = fread(buf, 1, sizeof(buf), file));
-		offset += size
-	) {
+static void tables(void) {
+	for (int i = 0; i < 256; ++i) {
+		Hex[i][0] = Digits[i >> 4];
+		Hex[i][1] = Digits[i & 0xF];
+		Hex[i][2] = ' ';
+		ASCII[i] = (isprint(i) ? i : '.');
+	}
+}
+
+static struct {
+	char *buf;
+	size_t len;
+	size_t cap;
+} out;
+
+static void flush(void) {
+	if (out.len && !fwrite(out.buf, out.len, 1, stdout)) {
+		err(EX_IOERR, "(stdout)");
+	}
+	out.len = 0;
+}
+
+static char *putOffset(char *ptr, size_t offset) {
+	char digits[2 * sizeof(offset)];
+	size_t n = 0;
+	do {
+		digits[n++] = Digits[offset & 0xF];
+		offset >>= 4;
+	} while (offset);
+	for (size_t i = n; i < 8; ++i) *ptr++ = '0';
+	while (n) *ptr++ = digits[--n];
+	*ptr++ = ':';
+	*ptr++ = ' ';
+	*ptr++ = ' ';
+	return ptr;
+}
+
+static void line(const byte *buf, size_t size, size_t offset) {
+	// Offset, hex with group spaces, ASCII with group spaces, newline:
+	size_t groups = (options.group ? options.cols / options.group + 1 : 0);
+	size_t max = 2 * sizeof(offset) + 3 + 4 * options.cols + 2 * groups + 3;
+	if (out.len + max > out.cap) flush();
+	char *ptr = &out.buf[out.len];
+
+	if (options.offset) ptr = putOffset(ptr, offset);
+
+	size_t group = options.group;
+	for (size_t i = 0, g = 0; i < options.cols; ++i, ++g) {
+		if (g == group && i) {
+			*ptr++ = ' ';
+			g = 0;
+		}
+		if (i < size) {
+			memcpy(ptr, Hex[buf[i]], 3);
+		} else {
+			memcpy(ptr, "   ", 3);
+		}
+		ptr += 3;
+	}
+
+	if (options.ascii) {
+		*ptr++ = ' ';
+		for (size_t i = 0, g = 0; i < size; ++i, ++g) {
+			if (g == group && i) {
+				*ptr++ = ' ';
+				g = 0;
+			}
+			*ptr++ = ASCII[buf[i]];
+		}
+	}
+
+	*ptr++ = '\n';
+	out.len = ptr - out.buf;
+}
+
+static size_t lineMax(void) {
+	// A line, a preceding blank line or a skipped line marker:
+	size_t groups = (options.group ? options.cols / options.group + 1 : 0);
+	return 2 * sizeof(size_t) + 3 + 4 * options.cols + 2 * groups + 3 + 2;
+}
+
+static struct {
+	size_t offset;
+	size_t length;
+	bool skip;
+} range = { 0, SIZE_MAX, false };
+
+static size_t lines(const byte *buf, size_t len, size_t offset, bool eof) {
+	size_t cols = options.cols;
+	size_t pos = 0;
+	for (; pos < len && (len - pos >= cols || eof); pos += cols) {
+		size_t size = (len - pos < cols ? len - pos : cols);
+		const byte *ptr = &buf[pos];
 		if (options.skip) {
-			if (zero(buf, size)) {
-				if (!skip) printf("*\n");
-				skip = true;
+			if (zero(ptr, size)) {
+				if (!range.skip) {
+					if (out.len + 2 > out.cap) flush();
+					memcpy(&out.buf[out.len], "*\n", 2);
+					out.len += 2;
+				}
+				range.skip = true;
+				offset += size;
 				continue;
 			} else {
-				skip = false;
+				range.skip = false;
 			}
 		}
-
 		if (options.blank) {
-			if (offset && offset % options.blank == 0) {
-				printf("\n");
+			if (offset > range.offset && offset % options.blank == 0) {
+				if (out.len + 1 > out.cap) flush();
+				out.buf[out.len++] = '\n';
 			}
 		}
+		line(ptr, size, offset);
+		offset += size;
+	}
+	return (pos > len ? len : pos);
+}
 
-		if (options.offset) {
-			printf("%08zX:  ", offset);
+static void seek(int fd) {
+	if (!range.offset) return;
+	if (lseek(fd, range.offset, SEEK_SET) >= 0) return;
+	if (errno != ESPIPE) err(EX_IOERR, "lseek");
+	char buf[64 * 1024];
+	for (size_t skip = range.offset; skip;) {
+		ssize_t n = read(fd, buf, (skip < sizeof(buf) ? skip : sizeof(buf)));
+		if (n < 0) err(EX_IOERR, "read");
+		if (!n) break;
+		skip -= n;
+	}
+}
+
+static void dump(int fd) {
+	seek(fd);
+	size_t cols = options.cols;
+	size_t cap = (64 * 1024 / cols + 1) * cols;
+	byte *buf = malloc(cap);
+	if (!buf) err(EX_OSERR, "malloc");
+
+	size_t offset = range.offset;
+	size_t remain = range.length;
+	size_t len = 0;
+	for (bool eof = false; !eof || len;) {
+		ssize_t n = 0;
+		size_t want = cap - len;
+		if (want > remain) want = remain;
+		if (!eof && want) n = read(fd, &buf[len], want);
+		if (n < 0) err(EX_IOERR, "read");
+		if (!n) eof = true;
+		len += n;
+		remain -= n;
+
+		size_t pos = lines(buf, len, offset, eof);
+		offset += pos;
+		memmove(buf, &buf[pos], len - pos);
+		len -= pos;
+	}
+	free(buf);
+}
+
+static void preadFull(int fd, byte *buf, size_t len, size_t offset) {
+	while (len) {
+		ssize_t n = pread(fd, buf, len, offset);
+		if (n < 0) err(EX_IOERR, "pread");
+		if (!n) errx(EX_IOERR, "file truncated");
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+}
+
+static void writeFull(int fd, const void *ptr, size_t len) {
+	const char *buf = ptr;
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) err(EX_IOERR, "write");
+		buf += n;
+		len -= n;
+	}
+}
+
+static bool readFull(int fd, void *ptr, size_t len) {
+	char *buf = ptr;
+	while (len) {
+		ssize_t n = read(fd, buf, len);
+		if (n < 0) err(EX_IOERR, "read");
+		if (!n) return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+// Chunks of the range are formatted by jobs worker processes in turn, each
+// writing the length and output of its chunks to its own pipe, from which
+// they are copied in order. A worker formats its next chunk while the
+// previous one waits to be copied.
+static void dumpChunks(int fd, size_t end, size_t jobs) {
+	size_t cols = options.cols;
+	size_t size = (1024 * 1024 / cols + 1) * cols;
+	size_t count = (end - range.offset + size - 1) / size;
+	if (jobs > count) jobs = count;
+
+	int *pipes = calloc(jobs, sizeof(*pipes));
+	pid_t *pids = calloc(jobs, sizeof(*pids));
+	if (!pipes || !pids) err(EX_OSERR, "calloc");
+
+	flush();
+	fflush(stdout);
+	for (size_t i = 0; i < jobs; ++i) {
+		int rw[2];
+		int error = pipe(rw);
+		if (error) err(EX_OSERR, "pipe");
+		pids[i] = fork();
+		if (pids[i] < 0) err(EX_OSERR, "fork");
+		if (pids[i]) {
+			close(rw[1]);
+			pipes[i] = rw[0];
+			continue;
 		}
 
-		for (size_t i = 0; i < sizeof(buf); ++i) {
-			if (options.group) {
-				if (i && !(i % options.group)) {
-					printf(" ");
-				}
+		close(rw[0]);
+		for (size_t j = 0; j < i; ++j) close(pipes[j]);
+		byte *buf = malloc(size);
+		out.cap = (size / cols) * lineMax();
+		free(out.buf);
+		out.buf = malloc(out.cap);
+		if (!buf || !out.buf) err(EX_OSERR, "malloc");
+		for (size_t c = i; c < count; c += jobs) {
+			size_t offset = range.offset + c * size;
+			size_t len = (end - offset < size ? end - offset : size);
+			// Resume skipping zeros if the previous chunk ended in them:
+			range.skip = false;
+			if (options.skip && c) {
+				preadFull(fd, buf, cols, offset - cols);
+				range.skip = zero(buf, cols);
 			}
-			if (i < size) {
-				printf("%02hhX ", buf[i]);
-			} else {
-				printf("   ");
+			preadFull(fd, buf, len, offset);
+			out.len = 0;
+			lines(buf, len, offset, true);
+			writeFull(rw[1], &out.len, sizeof(out.len));
+			writeFull(rw[1], out.buf, out.len);
+		}
+		_exit(EX_OK);
+	}
+
+	for (size_t c = 0; c < count; ++c) {
+		int rd = pipes[c % jobs];
+		size_t len;
+		if (!readFull(rd, &len, sizeof(len))) break;
+		while (len) {
+			if (out.len == out.cap) flush();
+			size_t n = out.cap - out.len;
+			if (n > len) n = len;
+			if (!readFull(rd, &out.buf[out.len], n)) {
+				errx(EX_SOFTWARE, "chunk %zu: truncated", c);
 			}
+			out.len += n;
+			len -= n;
 		}
+	}
+	flush();
 
-		if (options.ascii) {
-			printf(" ");
-			for (size_t i = 0; i < size; ++i) {
-				if (options.group) {
-					if (i && !(i % options.group)) {
-						printf(" ");
-					}
-				}
-				printf("%c", isprint(buf[i]) ? buf[i] : '.');
+	for (size_t i = 0; i < jobs; ++i) {
+		int status;
+		pid_t pid = waitpid(pids[i], &status, 0);
+		if (pid < 0) err(EX_OSERR, "waitpid");
+		if (WIFSIGNALED(status)) {
+			errx(EX_SOFTWARE, "job %zu: signal %d", i, WTERMSIG(status));
+		}
+		if (WEXITSTATUS(status)) exit(WEXITSTATUS(status));
+		close(pipes[i]);
+	}
+	free(pipes);
+	free(pids);
+}
+
+static byte Value[256];
+
+static void fill(size_t len) {
+	while (len) {
+		if (out.len == out.cap) flush();
+		size_t n = out.cap - out.len;
+		if (n > len) n = len;
+		memset(&out.buf[out.len], 0, n);
+		out.len += n;
+		len -= n;
+	}
+}
+
+// Parse hex pairs, skipping the offset and ASCII columns of lines in the
+// format written by dump. Offsets past the output written so far, as after
+// lines skipped by -z, are filled with zeros.
+static struct {
+	bool start;
+	bool columns;
+	bool ascii;
+	size_t bytes;
+	size_t spaces;
+	size_t offset;
+} state = { .start = true };
+
+static void parse(const char *ptr, const char *end) {
+	while (ptr < end) {
+		if (*ptr == '\n') {
+			state.start = true;
+			state.ascii = false;
+			ptr++;
+			continue;
+		}
+		if (state.ascii || (state.start && *ptr == '*')) {
+			state.start = false;
+			state.ascii = true;
+			const char *nl = memchr(ptr, '\n', end - ptr);
+			ptr = (nl ? nl : end);
+			continue;
+		}
+		if (*ptr == ' ' || *ptr == '\t' || *ptr == '\r') {
+			state.spaces++;
+			ptr++;
+			continue;
+		}
+
+		if (state.columns && state.bytes && state.spaces > 2) {
+			// The ASCII column of a short last line:
+			state.ascii = true;
+			continue;
+		}
+
+		const char *run = ptr;
+		while (ptr < end && Value[(byte)*ptr] != 0xFF) ptr++;
+		if (ptr == run) errx(EX_DATAERR, "invalid input");
+		if (state.start && ptr < end && *ptr == ':') {
+			size_t offset = 0;
+			for (; run < ptr; ++run) {
+				offset = offset << 4 | Value[(byte)*run];
 			}
+			if (offset > state.offset) {
+				fill(offset - state.offset);
+				state.offset = offset;
+			}
+			state.start = false;
+			state.columns = options.ascii;
+			state.bytes = 0;
+			state.spaces = 0;
+			ptr++;
+			continue;
+		}
+		if ((ptr - run) % 2) errx(EX_DATAERR, "invalid input");
+		if (state.start) {
+			// Without an offset column, only expect an ASCII column if
+			// the dump was made without offsets.
+			state.start = false;
+			state.columns = options.ascii && !options.offset;
+			state.bytes = 0;
 		}
+		state.spaces = 0;
 
-		printf("\n");
+		while (run < ptr) {
+			if (out.len == out.cap) flush();
+			size_t n = (ptr - run) / 2;
+			if (n > out.cap - out.len) n = out.cap - out.len;
+			byte *bytes = (byte *)&out.buf[out.len];
+			for (size_t i = 0; i < n; ++i, run += 2) {
+				bytes[i] = Value[(byte)run[0]] << 4 | Value[(byte)run[1]];
+			}
+			out.len += n;
+			state.offset += n;
+			state.bytes += n;
+		}
+		if (state.columns && state.bytes >= options.cols) state.ascii = true;
 	}
 }
 
-static void undump(FILE *file) {
-	byte c;
-	int match;
-	while (0 < (match = fscanf(file, " %hhx", &c))) {
-		printf("%c", c);
+static void undump(int fd) {
+	memset(Value, 0xFF, sizeof(Value));
+	for (int i = 0; i < 16; ++i) {
+		Value[(byte)Digits[i]] = i;
+		Value[(byte)tolower(Digits[i])] = i;
+	}
+	out.cap = 1024 * 1024;
+	out.buf = malloc(out.cap);
+	size_t cap = 1024 * 1024;
+	char *buf = malloc(cap);
+	if (!out.buf || !buf) err(EX_OSERR, "malloc");
+
+	size_t len = 0;
+	for (ssize_t n; 0 < (n = read(fd, &buf[len], cap - len));) {
+		len += n;
+		// Leave any token cut off at the end for the next read:
+		size_t pos = len;
+		while (pos && !strchr(" \t\r\n", buf[pos-1])) pos--;
+		if (!pos && len == cap) {
+			buf = realloc(buf, (cap *= 2));
+			if (!buf) err(EX_OSERR, "realloc");
+			continue;
+		}
+		parse(buf, &buf[pos]);
+		memmove(buf, &buf[pos], len - pos);
+		len -= pos;
 	}
-	if (!match) errx(EX_DATAERR, "invalid input");
+	parse(buf, &buf[len]);
+	flush();
+	free(buf);
+	free(out.buf);
 }
 
 int main(int argc, char *argv[]) {
 	bool reverse = false;
 	const char *path = NULL;
 
+	size_t jobs = 1;
+
 	int opt;
-	while (0 < (opt = getopt(argc, argv, "ac:g:p:rsz"))) {
+	while (0 < (opt = getopt(argc, argv, "ac:g:j:n:o:p:rsz"))) {
 		switch (opt) {
 			break; case 'a': options.ascii ^= true;
 			break; case 'c': options.cols = strtoul(optarg, NULL, 0);
 			break; case 'g': options.group = strtoul(optarg, NULL, 0);
+			break; case 'j': jobs = strtoul(optarg, NULL, 10);
+			break; case 'n': range.length = strtoull(optarg, NULL, 0);
+			break; case 'o': range.offset = strtoull(optarg, NULL, 0);
 			break; case 'p': options.blank = strtoul(optarg, NULL, 0);
 			break; case 'r': reverse = true;
 			break; case 's': options.offset ^= true;
@@ -126,15 +479,32 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	if (argc > optind) path = argv[optind];
-	if (!options.cols) return EX_USAGE;
+	if (!options.cols || !jobs) return EX_USAGE;
 
 	FILE *file = path ? fopen(path, "r") : stdin;
 	if (!file) err(EX_NOINPUT, "%s", path);
 
 	if (reverse) {
-		undump(file);
+		undump(fileno(file));
 	} else {
-		dump(file);
+		tables();
+		out.cap = 256 * 1024 + 8 * options.cols;
+		out.buf = malloc(out.cap);
+		if (!out.buf) err(EX_OSERR, "malloc");
+
+		struct stat st;
+		int error = fstat(fileno(file), &st);
+		if (error) err(EX_IOERR, "%s", path);
+		size_t end = range.offset + range.length;
+		if (end < range.offset) end = SIZE_MAX;
+		if (S_ISREG(st.st_mode) && end > (size_t)st.st_size) end = st.st_size;
+		if (jobs > 1 && S_ISREG(st.st_mode) && end > range.offset) {
+			dumpChunks(fileno(file), end, jobs);
+		} else {
+			dump(fileno(file));
+		}
+		flush();
+		free(out.buf);
 	}
 	if (ferror(file)) err(EX_IOERR, "%s", path);
 
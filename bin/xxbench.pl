@@ -0,0 +1,66 @@
+#!/usr/bin/env perl
+use strict;
+use warnings;
+use File::Compare qw(compare);
+use File::Temp qw(tempfile);
+use Time::HiRes qw(time);
+
+# Compare the throughput and output of xx with a base build of it:
+# xxbench.pl [-r runs] [-s MiB] ./xx [./xx.base]
+my %opts;
+while (@ARGV && $ARGV[0] =~ /^-([rs])$/) {
+	shift;
+	$opts{$1} = shift;
+}
+my ($xx, $base) = @ARGV;
+die "usage: $0 [-r runs] [-s MiB] xx [base]\n" unless $xx;
+my $runs = $opts{r} // 5;
+my $size = ($opts{s} // 64) * 1024 * 1024;
+my @flags = ('', '-a', '-s', '-z', '-c 32 -g 4', '-g 0', '-p 4096');
+
+sub corpus {
+	my ($file, $path) = tempfile(UNLINK => 1);
+	open my $random, '<', '/dev/urandom' or die "/dev/urandom: $!\n";
+	my $len = 0;
+	while ($len < $size) {
+		# Mix random bytes, text and runs of zeros for -z:
+		read $random, my $bytes, 48 * 1024;
+		print $file $bytes, 'text ' x 1024, "\0" x 8192;
+		$len += length($bytes) + 5 * 1024 + 8192;
+	}
+	close $file;
+	return ($path, $len);
+}
+
+sub run {
+	my ($bin, $flags, $path) = @_;
+	my $best;
+	for (1 .. $runs) {
+		my $start = time;
+		system("$bin $flags $path >/dev/null") == 0 or die "$bin $flags failed\n";
+		my $time = time - $start;
+		$best = $time if !defined $best || $time < $best;
+	}
+	return $best;
+}
+
+my $different = 0;
+my ($path, $len) = corpus;
+printf "%-12s %10s %10s %8s\n", qw(flags MB/s base speedup);
+for my $flags (@flags) {
+	my $mbps = $len / run($xx, $flags, $path) / 1e6;
+	printf "%-12s %10.2f", ($flags || '(none)'), $mbps;
+	if ($base) {
+		my $bmbps = $len / run($base, $flags, $path) / 1e6;
+		printf " %10.2f %7.1fx", $bmbps, $mbps / $bmbps;
+		my (undef, $out) = tempfile(UNLINK => 1);
+		my (undef, $bout) = tempfile(UNLINK => 1);
+		system("$xx $flags $path >$out; $base $flags $path >$bout");
+		if (compare($out, $bout)) {
+			print ' DIFFERENT';
+			$different++;
+		}
+	}
+	print "\n";
+}
+exit ($different ? 1 : 0);